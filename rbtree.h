@@ -8,6 +8,7 @@
 #ifndef RBTREE_H
 # define RBTREE_H
 
+#include <assert.h>
 #include <stddef.h> // offsetof
 
 #include "rbtree_types.h"
@@ -19,15 +20,109 @@
 })
 
 extern t_rbnode*  rb_find(const void* key, const t_rbtree* tree, t_compare cmp);
+extern t_rbnode*  rb_lower_bound(const void* key, const t_rbtree* tree, t_compare cmp);
+extern t_rbnode*  rb_upper_bound(const void* key, const t_rbtree* tree, t_compare cmp);
+extern void       rb_equal_range(const void* key, const t_rbtree* tree, t_compare cmp, t_rbnode** first, t_rbnode** end);
+extern size_t     rb_count_equal(const void* key, const t_rbtree* tree, t_compare cmp);
+extern t_rbnode*  rb_find_insert_pos(const void* key, t_rbtree* tree, t_compare cmp, t_rbnode** parent, t_rbnode*** link);
+extern void       rb_find_batch(const void* const* keys, size_t n, const t_rbtree* tree, t_compare cmp, t_rbnode** out);
 extern t_rbnode*  rb_next(t_rbnode* node);
 extern t_rbnode*  rb_first(t_rbtree* tree);
-// extern t_rbnode*  rb_prev(t_rbnode* node);
+extern t_rbnode*  rb_prev(t_rbnode* node);
+extern t_rbnode*  rb_last(t_rbtree* tree);
+
+extern t_rbnode*  rb_first_postorder(t_rbtree* tree);
+extern t_rbnode*  rb_next_postorder(t_rbnode* node);
 
 extern void rb_postorder_foreach(t_rbnode* node, void (*op)(t_rbnode*));
 
 extern void rb_insert(t_rbtree* tree, t_rbnode* node, t_less less);
 extern void rb_insert_cached(t_rbtree_cached* tree, t_rbnode* node, t_less less);
+extern void rb_insert_hint(t_rbtree* tree, t_rbnode* node, t_rbnode* hint, t_less less);
+extern void rb_insert_hint_cached(t_rbtree_cached* tree, t_rbnode* node, t_rbnode* hint, t_less less);
+extern void rb_insert_at(t_rbtree* tree, t_rbnode* node, t_rbnode* parent, t_rbnode** link);
+extern t_rbnode* rb_insert_unique(t_rbtree* tree, t_rbnode* node, t_less less);
+extern void rb_insert_batch(t_rbtree* tree, t_rbnode** nodes, size_t n, t_less less);
 extern void rb_erase(t_rbtree* tree, t_rbnode* node);
+extern void rb_insert_augmented(t_rbtree* tree, t_rbnode* node, t_less less, const t_rbaugment* aug);
+extern void rb_erase_augmented(t_rbtree* tree, t_rbnode* node, const t_rbaugment* aug);
+extern void rb_build_sorted(t_rbtree* tree, t_rbnode** nodes, size_t n);
+extern t_rbnode* rb_pop_first(t_rbtree_cached* tree);
+extern t_rbnode* rb_pop_last(t_rbtree_cached* tree);
+
+extern void rb_os_insert(t_rbtree_os* tree, t_rbnode_os* node, t_less less);
+extern void rb_os_erase(t_rbtree_os* tree, t_rbnode_os* node);
+extern t_rbnode_os* rb_select(const t_rbtree_os* tree, size_t rank);
+extern size_t rb_rank(const t_rbnode_os* node);
+extern size_t rb_count_less(const void* key, const t_rbtree_os* tree, t_compare cmp);
+
+extern void interval_insert(t_rbtree* tree, t_rbinterval* interval);
+extern void interval_erase(t_rbtree* tree, t_rbinterval* interval);
+extern t_rbinterval* interval_iter_first(const t_rbtree* tree, int64_t start, int64_t last);
+extern t_rbinterval* interval_iter_next(t_rbinterval* interval, int64_t start, int64_t last);
+
+extern bool rb_arena_init(t_rbarena* arena, size_t slot_size, size_t max_slots, bool huge_pages);
+extern void rb_arena_destroy(t_rbarena* arena);
+extern void rb_arena_reset(t_rbarena* arena);
+
+extern bool rb_freeze(t_rbtree* tree, int64_t (*key)(const t_rbnode*), t_rbsnapshot* snap);
+extern void rb_snapshot_destroy(t_rbsnapshot* snap);
+extern size_t rb_snapshot_lower_bound(const t_rbsnapshot* snap, int64_t key);
+extern size_t rb_snapshot_next(const t_rbsnapshot* snap, size_t pos);
+
+extern void rb_seq_insert(t_rbtree_seq* tree, t_rbnode* node, t_less less);
+extern void rb_seq_erase(t_rbtree_seq* tree, t_rbnode* node);
+extern t_rbnode* rb_seq_find(const void* key, const t_rbtree_seq* tree, t_compare cmp);
+extern t_rbnode* rb_seq_first(const t_rbtree_seq* tree);
+extern t_rbnode* rb_seq_next(const t_rbtree_seq* tree, t_rbnode* node);
+
+extern void rb_p_insert(t_rbptree* tree, void* item, t_pcompare cmp);
+extern void* rb_p_erase(t_rbptree* tree, const void* key, t_pcompare cmp);
+extern void* rb_p_find(const t_rbptree* tree, const void* key, t_pcompare cmp);
+extern t_rbptree rb_p_snapshot(const t_rbptree* tree);
+extern void rb_p_release(t_rbptree* tree);
+extern void* rb_p_first(const t_rbptree* tree, t_rbpiter* iter);
+extern void* rb_p_next(t_rbpiter* iter);
+
+extern bool rb_sched_init(t_rbsched* sched, int cpus);
+extern void rb_sched_destroy(t_rbsched* sched);
+extern void rb_sched_enqueue(t_rbsched* sched, int cpu, t_rbentity* se);
+extern void rb_sched_dequeue(t_rbsched* sched, t_rbentity* se);
+extern t_rbentity* rb_sched_pick_next(t_rbsched* sched, int cpu);
+extern t_rbentity* rb_sched_tick(t_rbsched* sched, int cpu, uint64_t delta_ns);
+extern size_t rb_sched_balance(t_rbsched* sched);
+
+extern bool rb_image_save(const char* path, t_rbtree* tree, size_t record_size, void (*store)(const t_rbnode*, void*));
+extern bool rb_image_open(t_rbimage* image, const char* path);
+extern void rb_image_close(t_rbimage* image);
+extern const void* rb_image_find(const t_rbimage* image, const void* key, t_pcompare cmp);
+extern const void* rb_image_lower_bound(const t_rbimage* image, const void* key, t_pcompare cmp);
+extern const void* rb_image_first(const t_rbimage* image);
+extern const void* rb_image_next(const void* record);
+
+extern void rb32_init(t_rbtree32* tree, t_rbnode32* nodes, const int64_t* keys);
+extern void rb32_insert(t_rbtree32* tree, uint32_t idx);
+extern void rb32_erase(t_rbtree32* tree, uint32_t idx);
+extern uint32_t rb32_find(const t_rbtree32* tree, int64_t key);
+extern uint32_t rb32_first(const t_rbtree32* tree);
+extern uint32_t rb32_next(const t_rbtree32* tree, uint32_t idx);
+
+extern void rb_td_insert(t_rbtree_td* tree, t_rbnode_td* node, t_less_td less);
+extern t_rbnode_td* rb_td_erase(t_rbtree_td* tree, const void* key, t_compare_td cmp);
+extern t_rbnode_td* rb_td_find(const void* key, const t_rbtree_td* tree, t_compare_td cmp);
+extern t_rbnode_td* rb_td_first(const t_rbtree_td* tree, t_rbiter_td* iter);
+extern t_rbnode_td* rb_td_next(t_rbiter_td* iter);
+
+extern void rb_join(t_rbtree* t1, t_rbnode* pivot, t_rbtree* t2);
+extern void rb_split(t_rbtree* tree, const void* key, t_compare cmp, t_rbtree* lt, t_rbtree* ge);
+extern void rb_erase_range(t_rbtree* tree, const void* lo, const void* hi, t_compare cmp, void (*cb)(t_rbnode*));
+extern void rb_clear(t_rbtree* tree, void (*cb)(t_rbnode*));
+extern void rb_erase_range_cached(t_rbtree_cached* tree, const void* lo, const void* hi, t_compare cmp, void (*cb)(t_rbnode*));
+extern void rb_clear_cached(t_rbtree_cached* tree, void (*cb)(t_rbnode*));
+extern void rb_union(t_rbtree* t1, t_rbtree* t2, t_less less, void (*drop)(t_rbnode*));
+extern void rb_intersection(t_rbtree* t1, t_rbtree* t2, t_less less, void (*drop)(t_rbnode*));
+extern void rb_difference(t_rbtree* t1, t_rbtree* t2, t_less less, void (*drop)(t_rbnode*));
+extern void rb_set_threads(int nthreads);
 
 extern t_rbnode* rb_nil;
 
@@ -37,39 +132,191 @@ rb_create_tree(void)
   return (t_rbtree){.root = rb_nil};
 }
 
+// empty caches are NULL, as returned by rb_first and rb_last.
 static inline t_rbtree_cached
 rb_create_tree_cached(void)
 {
   return (t_rbtree_cached){
     .rbtree = rb_create_tree(),
-    .leftmost_node = rb_nil,
+    .leftmost_node = NULL,
+    .rightmost_node = NULL,
   };
 }
 
+/*
+ * @tree: tree to tear down, left empty
+ * @free_fn: called once per node, children before parents
+ *
+ * one O(n) pass without rebalancing or recursion.
+ */
+static inline void
+rb_destroy(t_rbtree* tree, void (*free_fn)(t_rbnode*))
+{
+  rb_postorder_foreach(tree->root, free_fn);
+  tree->root = rb_nil;
+}
+
+// last freed slot first, it is the most likely to be in cache.
+// NULL once all max_slots of rb_arena_init are in use, the arena does not grow.
+static inline void*
+rb_arena_alloc(t_rbarena* arena)
+{
+  void* slot = arena->free_list;
+
+  if (slot != NULL) {
+    arena->free_list = *(void**)slot;
+    return slot;
+  }
+  if (arena->used + arena->slot_size > arena->size)
+    return NULL;
+  slot = arena->base + arena->used;
+  arena->used += arena->slot_size;
+  return slot;
+}
+
+static inline void
+rb_arena_free(t_rbarena* arena, void* slot)
+{
+  *(void**)slot = arena->free_list;
+  arena->free_list = slot;
+}
+
+static inline t_rbtree_seq
+rb_create_tree_seq(void)
+{
+  return (t_rbtree_seq){.rbtree = rb_create_tree(), .seq = 0};
+}
+
+static inline t_rbptree
+rb_create_tree_p(void)
+{
+  return (t_rbptree){.root = NULL, .size = 0};
+}
+
+static inline t_rbsnapshot
+rb_create_snapshot(void)
+{
+  return (t_rbsnapshot){.keys = NULL, .nodes = NULL, .size = 0, .capacity = 0};
+}
+
+// @weight is RB_SCHED_NICE_0_LOAD for nice 0, larger for a bigger share, never 0.
+static inline t_rbentity
+rb_create_entity(uint32_t weight)
+{
+  assert(weight != 0);
+  return (t_rbentity){.node = {}, .vruntime = 0, .weight = weight, .cpu = -1};
+}
+
+// a node with @key, NULL if none. the first of equal keys in order.
+static inline t_rbnode*
+rb_snapshot_find(const t_rbsnapshot* snap, int64_t key)
+{
+  size_t pos = rb_snapshot_lower_bound(snap, key);
+
+  if (pos == 0 || snap->keys[pos] != key)
+    return NULL;
+  return snap->nodes[pos];
+}
+
+static inline t_rbtree_os
+rb_create_tree_os(void)
+{
+  return (t_rbtree_os){.rbtree = rb_create_tree()};
+}
+
+static inline size_t
+rb_size(const t_rbtree_os* tree)
+{
+  if (tree->rbtree.root == rb_nil)
+    return 0;
+  return container_of(tree->rbtree.root, t_rbnode_os, node)->size;
+}
+
+// stabbing query: intervals containing @point, iterated with interval_stab_next.
+static inline t_rbinterval*
+interval_stab_first(const t_rbtree* tree, int64_t point)
+{
+  return interval_iter_first(tree, point, point);
+}
+
+static inline t_rbinterval*
+interval_stab_next(t_rbinterval* interval, int64_t point)
+{
+  return interval_iter_next(interval, point, point);
+}
+
+// the leftmost node has no left child and the rightmost has no right child,
+// so both neighbours are found in O(1).
 static inline void
 rb_erase_cached(t_rbtree_cached* tree, t_rbnode* node)
 {
   if (tree->leftmost_node == node) {
     tree->leftmost_node = rb_next(node);
   }
+  if (tree->rightmost_node == node) {
+    tree->rightmost_node = rb_prev(node);
+  }
   rb_erase(&tree->rbtree, node);
 }
 
+static inline void
+rb_build_sorted_cached(t_rbtree_cached* tree, t_rbnode** nodes, size_t n)
+{
+  rb_build_sorted(&tree->rbtree, nodes, n);
+  tree->leftmost_node = n ? nodes[0] : NULL;
+  tree->rightmost_node = n ? nodes[n - 1] : NULL;
+}
+
 static inline t_rbnode*
 rb_find_cached(const void* key, const t_rbtree_cached* tree, t_compare cmp)
 {
-  if (cmp(key, tree->leftmost_node)) {
+  if (tree->leftmost_node == NULL) {
+    return NULL;
+  }
+  int cmp_ret = cmp(key, tree->leftmost_node);
+  if (cmp_ret == 0) {
     return tree->leftmost_node;
   }
+  if (cmp_ret < 0) {
+    return NULL;
+  }
   return rb_find(key, &tree->rbtree, cmp);
 }
 
+// key based rb_insert_unique, the path for deduplicating ingest: a duplicate
+// stops the descent at the equal node. @node must already hold @key.
+static inline t_rbnode*
+rb_insert_unique_key(t_rbtree* tree, const void* key, t_rbnode* node, t_compare cmp)
+{
+  t_rbnode*   parent;
+  t_rbnode**  link;
+  t_rbnode*   found = rb_find_insert_pos(key, tree, cmp, &parent, &link);
+
+  if (found == NULL) {
+    rb_insert_at(tree, node, parent, link);
+  }
+  return found;
+}
+
 static inline t_rbnode*
 rb_leftmost(t_rbtree_cached* tree)
 {
   return tree->leftmost_node;
 }
 
+static inline t_rbnode*
+rb_rightmost(t_rbtree_cached* tree)
+{
+  return tree->rightmost_node;
+}
+
+// for augment callbacks walking up the tree
+static inline t_rbnode*
+rb_parent(const t_rbnode* node)
+{
+  return (t_rbnode*)((uintptr_t)node->pc.parent & ~1);
+}
+
 static inline bool
 rb_is_nil(t_rbnode* node)
 {
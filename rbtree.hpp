@@ -0,0 +1,475 @@
+/*
+ * rbtree.hpp
+ *
+ * Header-only C++ front end of the red-black tree.
+ * Descents are generated per comparator so the comparison is inlined,
+ * while linking, rebalancing and erasing reuse rbtree_write.c.
+ */
+
+#ifndef RBTREE_HPP
+# define RBTREE_HPP
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <tuple>
+#include <utility>
+
+#include "rbtree.h"
+
+namespace rb {
+
+/*
+ * @T: container type embedding a t_rbnode
+ * @Node: pointer to the embedded t_rbnode member
+ * @Compare: strict weak ordering on T.
+ *  lookups with a key of another type need Compare(key, T) and Compare(T, key).
+ *
+ * the tree does not own its elements. equal elements are kept in insertion order.
+ */
+template <class T, t_rbnode T::*Node, class Compare = std::less<T> >
+class intrusive_tree
+{
+public:
+  typedef T           value_type;
+  typedef T&          reference;
+  typedef const T&    const_reference;
+  typedef std::size_t size_type;
+  typedef Compare     value_compare;
+
+  class iterator
+  {
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef T                         value_type;
+    typedef std::ptrdiff_t            difference_type;
+    typedef T*                        pointer;
+    typedef T&                        reference;
+
+    iterator(void) : node_(NULL), tree_(NULL) {}
+    iterator(t_rbnode* node, t_rbtree_cached* tree) : node_(node), tree_(tree) {}
+
+    reference operator*(void) const { return *intrusive_tree::to_value(node_); }
+    pointer   operator->(void) const { return intrusive_tree::to_value(node_); }
+
+    iterator& operator++(void)
+    {
+      node_ = rb_next(node_);
+      return *this;
+    }
+    iterator  operator++(int)
+    {
+      iterator old = *this;
+      node_ = rb_next(node_);
+      return old;
+    }
+
+    iterator& operator--(void)
+    {
+      node_ = node_ ? rb_prev(node_) : rb_rightmost(tree_);
+      return *this;
+    }
+    iterator  operator--(int)
+    {
+      iterator old = *this;
+      --*this;
+      return old;
+    }
+
+    bool operator==(const iterator& other) const { return node_ == other.node_; }
+    bool operator!=(const iterator& other) const { return node_ != other.node_; }
+
+    t_rbnode* node(void) const { return node_; }
+
+  private:
+    // NULL is the past-the-end position, as returned by rb_next.
+    t_rbnode*         node_;
+    t_rbtree_cached*  tree_;
+  };
+
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+
+  explicit intrusive_tree(const Compare& comp = Compare())
+    : tree_(rb_create_tree_cached()), size_(0), comp_(comp) {}
+
+  // nodes are linked to the tree's address through the root, so it is not copyable.
+  intrusive_tree(const intrusive_tree&) = delete;
+  intrusive_tree& operator=(const intrusive_tree&) = delete;
+
+  iterator  begin(void) { return iterator(rb_leftmost(&tree_), &tree_); }
+  iterator  end(void) { return iterator(NULL, &tree_); }
+  reverse_iterator  rbegin(void) { return reverse_iterator(end()); }
+  reverse_iterator  rend(void) { return reverse_iterator(begin()); }
+  size_type size(void) const { return size_; }
+  bool      empty(void) const { return size_ == 0; }
+
+  // inserts after every element equal to @value.
+  iterator
+  insert(T& value)
+  {
+    t_rbnode**  link = &tree_.rbtree.root;
+    t_rbnode*   parent = rb_nil;
+
+    while (*link != rb_nil) {
+      parent = *link;
+      link = &parent->child[!comp_(value, *to_value(parent))];
+    }
+    return link_value(value, parent, link);
+  }
+
+  // inserts only if no equal element exists. one descent, one extra comparison.
+  std::pair<iterator, bool>
+  insert_unique(T& value)
+  {
+    t_rbnode**  link = &tree_.rbtree.root;
+    t_rbnode*   parent = rb_nil;
+    t_rbnode*   candidate = NULL;
+
+    while (*link != rb_nil) {
+      parent = *link;
+      bool dir = !comp_(value, *to_value(parent));
+      candidate = dir ? parent : candidate;
+      link = &parent->child[dir];
+    }
+    // candidate is the greatest element not greater than value.
+    if (candidate != NULL && !comp_(*to_value(candidate), value)) {
+      return std::make_pair(iterator(candidate, &tree_), false);
+    }
+    return std::make_pair(link_value(value, parent, link), true);
+  }
+
+  // returns the element following @pos.
+  iterator
+  erase(iterator pos)
+  {
+    iterator next = pos;
+
+    ++next;
+    rb_erase_cached(&tree_, pos.node());
+    --size_;
+    return next;
+  }
+
+  void
+  erase(T& value)
+  {
+    rb_erase_cached(&tree_, to_node(&value));
+    --size_;
+  }
+
+  // unlinks every element without touching them.
+  void
+  clear(void)
+  {
+    tree_ = rb_create_tree_cached();
+    size_ = 0;
+  }
+
+  // first element not less than @key.
+  template <class K>
+  iterator
+  lower_bound(const K& key)
+  {
+    t_rbnode* cur = tree_.rbtree.root;
+    t_rbnode* result = NULL;
+
+    while (cur != rb_nil) {
+      bool dir = comp_(*to_value(cur), key);
+      result = dir ? result : cur;
+      cur = cur->child[dir];
+    }
+    return iterator(result, &tree_);
+  }
+
+  // first element greater than @key.
+  template <class K>
+  iterator
+  upper_bound(const K& key)
+  {
+    t_rbnode* cur = tree_.rbtree.root;
+    t_rbnode* result = NULL;
+
+    while (cur != rb_nil) {
+      bool dir = !comp_(key, *to_value(cur));
+      result = dir ? result : cur;
+      cur = cur->child[dir];
+    }
+    return iterator(result, &tree_);
+  }
+
+  template <class K>
+  std::pair<iterator, iterator>
+  equal_range(const K& key)
+  {
+    return std::make_pair(lower_bound(key), upper_bound(key));
+  }
+
+  // an element equal to @key, end() if none. use lower_bound for the first one.
+  template <class K>
+  iterator
+  find(const K& key)
+  {
+    t_rbnode* cur = tree_.rbtree.root;
+
+    while (cur != rb_nil) {
+      bool lt = comp_(key, *to_value(cur));
+      bool gt = comp_(*to_value(cur), key);
+      if (!lt && !gt) {
+        return iterator(cur, &tree_);
+      }
+      cur = cur->child[gt];
+    }
+    return end();
+  }
+
+  template <class K>
+  size_type
+  count(const K& key)
+  {
+    size_type n = 0;
+
+    for (iterator itr = lower_bound(key); itr != end() && !comp_(key, *itr); ++itr) {
+      ++n;
+    }
+    return n;
+  }
+
+  t_rbtree_cached*  raw(void) { return &tree_; }
+  const Compare&    value_comp(void) const { return comp_; }
+
+  static T*
+  to_value(const t_rbnode* node)
+  {
+    return reinterpret_cast<T*>(reinterpret_cast<char*>(const_cast<t_rbnode*>(node)) - node_offset());
+  }
+
+  static t_rbnode*
+  to_node(T* value)
+  {
+    return &(value->*Node);
+  }
+
+private:
+  // the cache is updated here since rb_insert_at only knows the plain tree.
+  iterator
+  link_value(T& value, t_rbnode* parent, t_rbnode** link)
+  {
+    t_rbnode* node = to_node(&value);
+
+    if (tree_.leftmost_node == NULL || (parent == tree_.leftmost_node && link == &parent->left)) {
+      tree_.leftmost_node = node;
+    }
+    if (tree_.rightmost_node == NULL || (parent == tree_.rightmost_node && link == &parent->right)) {
+      tree_.rightmost_node = node;
+    }
+    rb_insert_at(&tree_.rbtree, node, parent, link);
+    ++size_;
+    return iterator(node, &tree_);
+  }
+
+  // offsetof for a pointer to member, taken on storage shaped like a T
+  // instead of a null pointer.
+  static std::ptrdiff_t
+  node_offset(void)
+  {
+    alignas(T) static char storage[sizeof(T)];
+    const T* object = reinterpret_cast<const T*>(storage);
+
+    return reinterpret_cast<const char*>(&(object->*Node)) - storage;
+  }
+
+  t_rbtree_cached tree_;
+  size_type       size_;
+  Compare         comp_;
+};
+
+/*
+ * ordered map with unique keys that owns its entries.
+ * entries are allocated one by one and never move while they are in the map.
+ */
+template <class Key, class Value, class Compare = std::less<Key> >
+class map
+{
+public:
+  typedef Key                             key_type;
+  typedef Value                           mapped_type;
+  typedef std::pair<const Key, Value>     value_type;
+  typedef std::size_t                     size_type;
+  typedef Compare                         key_compare;
+
+private:
+  struct entry
+  {
+    t_rbnode    node;
+    value_type  value;
+
+    template <class... Args>
+    explicit entry(Args&&... args) : value(std::forward<Args>(args)...) {}
+  };
+
+  // orders entries by key and compares keys against entries for lookups.
+  struct entry_compare
+  {
+    Compare comp;
+
+    explicit entry_compare(const Compare& c = Compare()) : comp(c) {}
+
+    bool operator()(const entry& a, const entry& b) const { return comp(a.value.first, b.value.first); }
+    bool operator()(const Key& a, const entry& b) const { return comp(a, b.value.first); }
+    bool operator()(const entry& a, const Key& b) const { return comp(a.value.first, b); }
+  };
+
+  typedef intrusive_tree<entry, &entry::node, entry_compare> tree_type;
+
+public:
+  class iterator
+  {
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef map::value_type           value_type;
+    typedef std::ptrdiff_t            difference_type;
+    typedef value_type*               pointer;
+    typedef value_type&               reference;
+
+    iterator(void) {}
+    explicit iterator(typename tree_type::iterator itr) : itr_(itr) {}
+
+    reference operator*(void) const { return itr_->value; }
+    pointer   operator->(void) const { return &itr_->value; }
+
+    iterator& operator++(void)
+    {
+      ++itr_;
+      return *this;
+    }
+    iterator  operator++(int)
+    {
+      iterator old = *this;
+      ++itr_;
+      return old;
+    }
+
+    iterator& operator--(void)
+    {
+      --itr_;
+      return *this;
+    }
+    iterator  operator--(int)
+    {
+      iterator old = *this;
+      --itr_;
+      return old;
+    }
+
+    bool operator==(const iterator& other) const { return itr_ == other.itr_; }
+    bool operator!=(const iterator& other) const { return itr_ != other.itr_; }
+
+  private:
+    friend class map;
+
+    typename tree_type::iterator itr_;
+  };
+
+  explicit map(const Compare& comp = Compare()) : tree_(entry_compare(comp)) {}
+  ~map(void) { clear(); }
+
+  map(const map&) = delete;
+  map& operator=(const map&) = delete;
+
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+
+  iterator  begin(void) { return iterator(tree_.begin()); }
+  iterator  end(void) { return iterator(tree_.end()); }
+  reverse_iterator  rbegin(void) { return reverse_iterator(end()); }
+  reverse_iterator  rend(void) { return reverse_iterator(begin()); }
+  size_type size(void) const { return tree_.size(); }
+  bool      empty(void) const { return tree_.empty(); }
+
+  template <class... Args>
+  std::pair<iterator, bool>
+  emplace(Args&&... args)
+  {
+    entry* e = new entry(std::forward<Args>(args)...);
+    std::pair<typename tree_type::iterator, bool> ret = tree_.insert_unique(*e);
+
+    if (ret.second == false) {
+      delete e;
+    }
+    return std::make_pair(iterator(ret.first), ret.second);
+  }
+
+  std::pair<iterator, bool>
+  insert(const value_type& value)
+  {
+    iterator itr = find(value.first);
+
+    if (itr != end()) {
+      return std::make_pair(itr, false);
+    }
+    return emplace(value);
+  }
+
+  Value&
+  operator[](const Key& key)
+  {
+    iterator itr = lower_bound(key);
+
+    if (itr == end() || tree_.value_comp().comp(key, itr->first)) {
+      itr = emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple()).first;
+    }
+    return itr->second;
+  }
+
+  iterator
+  erase(iterator pos)
+  {
+    entry* e = &*pos.itr_;
+    iterator next(tree_.erase(pos.itr_));
+
+    delete e;
+    return next;
+  }
+
+  size_type
+  erase(const Key& key)
+  {
+    iterator itr = find(key);
+
+    if (itr == end()) {
+      return 0;
+    }
+    erase(itr);
+    return 1;
+  }
+
+  void
+  clear(void)
+  {
+    rb_postorder_foreach(tree_.raw()->rbtree.root, destroy_entry);
+    tree_.clear();
+  }
+
+  iterator  find(const Key& key) { return iterator(tree_.find(key)); }
+  iterator  lower_bound(const Key& key) { return iterator(tree_.lower_bound(key)); }
+  iterator  upper_bound(const Key& key) { return iterator(tree_.upper_bound(key)); }
+  size_type count(const Key& key) { return find(key) != end(); }
+
+  std::pair<iterator, iterator>
+  equal_range(const Key& key)
+  {
+    return std::make_pair(lower_bound(key), upper_bound(key));
+  }
+
+private:
+  static void
+  destroy_entry(t_rbnode* node)
+  {
+    delete tree_type::to_value(node);
+  }
+
+  tree_type tree_;
+};
+
+} // namespace rb
+
+#endif // RBTREE_HPP
@@ -0,0 +1,95 @@
+/*
+ * rbtree_arena.c
+ *
+ * Arena of fixed size slots for the nodes of one tree.
+ * A single virtual range is reserved up front and only touched pages get
+ * backed by memory, so slots handed out one after another stay contiguous,
+ * and the whole arena goes back to the system with one munmap.
+ * The range does not grow: the capacity is fixed at init, and reserving a
+ * generous one costs only address space.
+ */
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "rbtree.h"
+
+// transparent huge pages are 2MB on x86-64 and arm64 with 4KB pages.
+static const size_t huge_page_size = (size_t)2 << 20;
+
+/*
+ * @arena: arena to set up
+ * @slot_size: size of a node container, rounded up to keep slots aligned
+ * @max_slots: fixed capacity, only reserved address space until used
+ * @huge_pages: ask for transparent huge pages to cut TLB misses on descents
+ *
+ * with @huge_pages the range starts and ends on a huge page boundary, so
+ * every part of it can be backed by one.
+ * returns false if the size overflows or the range could not be reserved.
+ */
+bool
+rb_arena_init(t_rbarena* arena, size_t slot_size, size_t max_slots, bool huge_pages)
+{
+  const size_t  align = sizeof(void*) * 2;
+  size_t        size;
+  size_t        reserved;
+  char*         base;
+  void*         map;
+
+  if (slot_size == 0 || slot_size > SIZE_MAX - align)
+    return false;
+  slot_size = (slot_size + align - 1) & ~(align - 1);
+  // room for the huge page round up and the alignment slack below
+  if (max_slots > (SIZE_MAX - 2 * huge_page_size) / slot_size)
+    return false;
+  size = slot_size * max_slots;
+  reserved = size;
+  if (huge_pages) {
+    size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+    reserved = size + huge_page_size;
+  }
+
+  map = mmap(NULL, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED)
+    return false;
+  base = (char*)map;
+  if (huge_pages) {
+    // mmap only aligns to pages, trim the reservation to an aligned range
+    base = (char*)(((uintptr_t)map + huge_page_size - 1) & ~(uintptr_t)(huge_page_size - 1));
+    if (base != (char*)map)
+      munmap(map, base - (char*)map);
+    if (base + size != (char*)map + reserved)
+      munmap(base + size, (char*)map + reserved - (base + size));
+  }
+#ifdef MADV_HUGEPAGE
+  // a hint, the kernel may ignore it
+  if (huge_pages)
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+
+  arena->base = base;
+  arena->free_list = NULL;
+  arena->slot_size = slot_size;
+  arena->used = 0;
+  arena->size = size;
+  return true;
+}
+
+// every slot is released at once, nodes still in a tree become invalid.
+void
+rb_arena_destroy(t_rbarena* arena)
+{
+  if (arena->base != NULL)
+    munmap(arena->base, arena->size);
+  arena->base = NULL;
+  arena->free_list = NULL;
+  arena->used = 0;
+  arena->size = 0;
+}
+
+// forgets every slot but keeps the reservation and its pages for reuse.
+void
+rb_arena_reset(t_rbarena* arena)
+{
+  arena->free_list = NULL;
+  arena->used = 0;
+}
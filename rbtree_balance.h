@@ -0,0 +1,351 @@
+/*
+ * rbtree_balance.h
+ *
+ * Rotation, unlinking and rebalancing shared by the node layouts.
+ * Included once per layout, after defining how a node is accessed:
+ *
+ *   RB_NODE                 node struct, handled by pointer
+ *   RB_TREE                 tree struct, always named tree in scope
+ *   RB_FN(name)             name of a generated function
+ *   RB_NIL                  black nil node, never written
+ *   RB_SET_ROOT(n)          makes n the root of tree
+ *   RB_CHILD(n, dir)        child on side dir, rb_left or rb_right
+ *   RB_SET_CHILD(n, dir, c)
+ *   RB_PARENT(n)
+ *   RB_SET_PARENT(n, p)     n is never nil
+ *   RB_COLOR(n)
+ *   RB_SET_COLOR(n, c)
+ *   RB_AUG_PARAM, RB_AUG_ARG
+ *                           extra parameter and argument for augment callbacks
+ *   RB_AUG_ROTATE(old, new_node)
+ *   RB_AUG_COPY(old, new_node)
+ *   RB_AUG_PROPAGATE(parent, successor)
+ *                           augment hooks, may expand to nothing
+ *
+ * Generates rotate_nodes, change_child, swap_edges, insert_balance,
+ * erase_node and erase_balance under RB_FN.
+ * The macros are undefined at the end.
+ */
+
+static inline void
+RB_FN(set_child_parent)(RB_TREE* tree, RB_NODE* child, RB_NODE* parent)
+{
+  (void)tree;
+  if (child != RB_NIL)
+    RB_SET_PARENT(child, parent);
+}
+
+// the child of @parent on side @dir takes its place.
+static inline void
+RB_FN(rotate_nodes)(RB_TREE* tree, RB_NODE* parent, uint8_t dir RB_AUG_PARAM)
+{
+  RB_NODE*  gparent = RB_PARENT(parent);
+  RB_NODE*  n = RB_CHILD(parent, dir);
+  RB_NODE*  c = RB_CHILD(n, !dir);
+
+  /*
+   *   g         g
+   *    \         \
+   *     p         n
+   *    / \       / \
+   *   n   b =>  a   p
+   *  / \           / \
+   * a   c         c   b
+   * for dir == rb_left, clockwise. the mirror image otherwise.
+   */
+  RB_SET_CHILD(parent, dir, c);
+  RB_FN(set_child_parent)(tree, c, parent);
+  RB_SET_CHILD(n, !dir, parent);
+  RB_SET_PARENT(parent, n);
+  if (gparent == RB_NIL)
+    RB_SET_ROOT(n);
+  else
+    RB_SET_CHILD(gparent, RB_CHILD(gparent, rb_right) == parent, n);
+  RB_SET_PARENT(n, gparent);
+  // n now roots the subtree parent used to
+  RB_AUG_ROTATE(parent, n);
+}
+
+static inline void
+RB_FN(change_child)(RB_TREE* tree, RB_NODE* parent, RB_NODE* old, RB_NODE* new_node)
+{
+  if (parent != RB_NIL)
+    RB_SET_CHILD(parent, RB_CHILD(parent, rb_right) == old, new_node);
+  else
+    RB_SET_ROOT(new_node);
+}
+
+static inline void
+RB_FN(swap_children)(RB_TREE* tree, RB_NODE* p1, RB_NODE* p2)
+{
+  for (uint8_t dir = rb_left; dir <= rb_right; ++dir) {
+    RB_NODE* child = RB_CHILD(p1, dir);
+
+    RB_FN(set_child_parent)(tree, child, p2);
+    RB_FN(set_child_parent)(tree, RB_CHILD(p2, dir), p1);
+    RB_SET_CHILD(p1, dir, RB_CHILD(p2, dir));
+    RB_SET_CHILD(p2, dir, child);
+  }
+}
+
+// exchanges the positions and colors of n1 and n2, whose parents are p1 and p2.
+static inline void
+RB_FN(swap_edges)(RB_TREE* tree, RB_NODE* p1, RB_NODE* p2, RB_NODE* n1, RB_NODE* n2)
+{
+  uint8_t   color = RB_COLOR(n1);
+  RB_NODE*  tmp;
+
+  RB_SET_COLOR(n1, RB_COLOR(n2));
+  RB_SET_COLOR(n2, color);
+  if (p2 == n1) {
+    // n2 is the child of n1 on side dir
+    uint8_t dir = RB_CHILD(n1, rb_right) == n2;
+
+    RB_FN(change_child)(tree, p1, n1, n2);
+    RB_SET_PARENT(n2, p1);
+    RB_SET_PARENT(n1, n2);
+    RB_FN(set_child_parent)(tree, RB_CHILD(n2, rb_left), n1);
+    RB_FN(set_child_parent)(tree, RB_CHILD(n2, rb_right), n1);
+    RB_FN(set_child_parent)(tree, RB_CHILD(n1, !dir), n2);
+    RB_SET_CHILD(n1, dir, RB_CHILD(n2, dir));
+    RB_SET_CHILD(n2, dir, n1);
+    tmp = RB_CHILD(n1, !dir);
+    RB_SET_CHILD(n1, !dir, RB_CHILD(n2, !dir));
+    RB_SET_CHILD(n2, !dir, tmp);
+    return;
+  }
+  else if (p1 == n2) {
+    // the same with the roles of n1 and n2 exchanged
+    RB_FN(swap_edges)(tree, p2, p1, n2, n1);
+    color = RB_COLOR(n1);
+    RB_SET_COLOR(n1, RB_COLOR(n2));
+    RB_SET_COLOR(n2, color);
+    return;
+  }
+  RB_FN(change_child)(tree, p1, n1, n2);
+  RB_SET_PARENT(n2, p1);
+  RB_FN(change_child)(tree, p2, n2, n1);
+  RB_SET_PARENT(n1, p2);
+  RB_FN(swap_children)(tree, n1, n2);
+}
+
+/*
+ * rebalances after the red @node was linked.
+ * returns true if the black height of the tree grew,
+ * which happens when the root is recolored from red.
+ */
+static ALWAYS_INLINE bool
+RB_FN(insert_balance)(RB_TREE* tree, RB_NODE* node RB_AUG_PARAM)
+{
+  // loop for recursion
+  while (true) {
+    RB_NODE* parent = RB_PARENT(node);
+
+    // case 1.
+    // previous root of the tree was nil and new node is root.
+    if (parent == RB_NIL) {
+      RB_SET_COLOR(node, BLACK);
+      return true;
+    }
+
+    // case 2.
+    // parent of inserted node is black.
+    if (RB_COLOR(parent) == BLACK) {
+      return false;
+    }
+
+    // case 3.
+    // uncle node is red.
+
+    // grand parent exists and its color is black because parent node is red.
+    RB_NODE*  gparent = RB_PARENT(parent);
+    uint8_t   p_dir = RB_CHILD(gparent, rb_right) == parent;
+    RB_NODE*  uncle = RB_CHILD(gparent, !p_dir);
+
+    if (RB_COLOR(uncle) == RED) {
+      RB_SET_COLOR(parent, BLACK);
+      RB_SET_COLOR(uncle, BLACK);
+      RB_SET_COLOR(gparent, RED);
+      node = gparent;
+      // recursive balancing as if gparent is inserted node.
+      continue;
+    }
+
+    // case 4.
+    // uncle node is black and has same branch direction with new node
+    uint8_t n_dir = RB_CHILD(parent, rb_right) == node;
+
+    if (n_dir != p_dir) {
+      RB_NODE* tmp = node;
+
+      RB_FN(rotate_nodes)(tree, parent, n_dir RB_AUG_ARG);
+      node = parent;
+      parent = tmp;
+    }
+
+    // case 5.
+    // uncle node is black and has different branch direction with new node
+    RB_FN(rotate_nodes)(tree, gparent, p_dir RB_AUG_ARG);
+    RB_SET_COLOR(parent, BLACK);
+    RB_SET_COLOR(gparent, RED);
+    return false;
+  }
+}
+
+/*
+ * handles erasing black node with no child.
+ * @parent lost that node and is the first node to rebalance.
+ */
+static ALWAYS_INLINE void
+RB_FN(erase_balance)(RB_TREE* tree, RB_NODE* parent RB_AUG_PARAM)
+{
+  RB_NODE*  node = RB_NIL;
+  RB_NODE*  sibling;
+  RB_NODE*  close_nephew;
+  RB_NODE*  far_nephew;
+  uint8_t   dir;
+
+  while (true) {
+    // case 1.
+    // Node is root. -1 black height on every path.
+    if (parent == RB_NIL) {
+      return;
+    }
+
+    // node is the child of parent on side dir
+    dir = node != RB_CHILD(parent, rb_left);
+    sibling = RB_CHILD(parent, !dir);
+    close_nephew = RB_CHILD(sibling, dir);
+    far_nephew = RB_CHILD(sibling, !dir);
+
+    // case 2.
+    // S is red and other nodes are black.
+    // as a result no change on black height, the node and parent, but with different S, C, F positions.
+    if (RB_COLOR(sibling) == RED) {
+      RB_FN(rotate_nodes)(tree, parent, !dir RB_AUG_ARG);
+      RB_SET_COLOR(sibling, BLACK);
+      RB_SET_COLOR(parent, RED);
+      // sibling has changed. set affected nodes accordingly.
+      sibling = RB_CHILD(parent, !dir);
+      close_nephew = RB_CHILD(sibling, dir);
+      far_nephew = RB_CHILD(sibling, !dir);
+    }
+
+case_3:
+    // case 3.
+    // F is red. sibling will inherit color of parent.
+    if (far_nephew != RB_NIL && RB_COLOR(far_nephew) == RED) {
+      RB_FN(rotate_nodes)(tree, parent, !dir RB_AUG_ARG);
+      RB_SET_COLOR(sibling, RB_COLOR(parent));
+      RB_SET_COLOR(parent, BLACK);
+      RB_SET_COLOR(far_nephew, BLACK);
+      return;
+    }
+
+    // case 4.
+    // C is red and F is black. sibling will inherit color of parent.
+    if (close_nephew != RB_NIL && RB_COLOR(close_nephew) == RED) {
+      RB_FN(rotate_nodes)(tree, sibling, dir RB_AUG_ARG);
+      RB_SET_COLOR(close_nephew, BLACK);
+      RB_SET_COLOR(sibling, RED);
+
+      // adjust nodes after rotation
+      far_nephew = sibling;
+      sibling = close_nephew;
+      close_nephew = RB_CHILD(close_nephew, dir);
+      goto case_3;
+    }
+
+    // case 5.
+    // P, S, C and F are black.
+    // one less black height on node side. requirement 5 is violated.
+    // change color of S as red and set P as new node and balance recursively.
+    // first iteration: the node is nil, other iterations: the node is root of subtree which has one less black height.
+    if (RB_COLOR(parent) == BLACK) {
+      RB_SET_COLOR(sibling, RED);
+      node = parent;
+      parent = RB_PARENT(parent);
+      continue;
+    }
+    // case 6.
+    // P is red and other nodes are black.
+    // changing color of P and S resolves requirement5 violation.
+    else {
+      RB_SET_COLOR(parent, BLACK);
+      RB_SET_COLOR(sibling, RED);
+      return;
+    }
+  }
+}
+
+static ALWAYS_INLINE void
+RB_FN(erase_node)(RB_TREE* tree, RB_NODE* node RB_AUG_PARAM)
+{
+  RB_NODE*  parent = RB_PARENT(node);
+  RB_NODE*  successor = NULL;
+
+  (void)successor;
+  // case 1.
+  // node has two children
+  // let successor of the node be leftmost node of right sub-tree.
+  // successor has either no child node or right child node.
+  if (RB_CHILD(node, rb_left) != RB_NIL && RB_CHILD(node, rb_right) != RB_NIL) {
+    successor = RB_CHILD(node, rb_right);
+    while (RB_CHILD(successor, rb_left) != RB_NIL) {
+      successor = RB_CHILD(successor, rb_left);
+    }
+    RB_FN(swap_edges)(tree, parent, RB_PARENT(successor), node, successor);
+    parent = RB_PARENT(node);
+    RB_AUG_COPY(node, successor);
+    // node and succesor is swapped. node has either no child or one child which will be handled later.
+  }
+
+  // case 2.
+  // node has one child which is red.
+  RB_NODE* child = RB_CHILD(node, RB_CHILD(node, rb_left) == RB_NIL);
+  if (child != RB_NIL) {
+    RB_FN(change_child)(tree, parent, node, child);
+    RB_SET_PARENT(child, parent);
+    RB_SET_COLOR(child, BLACK);
+    RB_AUG_PROPAGATE(parent, successor);
+    return; // no requirements are violated.
+  }
+
+  // case 3.
+  // node has no child and is root.
+  if (parent == RB_NIL) {
+    RB_SET_ROOT(RB_NIL);
+    return;
+  }
+
+  // case 4.
+  // node has no child and is red.
+  if (RB_COLOR(node) == RED) {
+    RB_FN(change_child)(tree, parent, node, RB_NIL);
+    RB_AUG_PROPAGATE(parent, successor);
+    return;
+  }
+
+  // case 5.
+  // node has no child and is black.
+  RB_FN(change_child)(tree, parent, node, RB_NIL);
+  RB_AUG_PROPAGATE(parent, successor);
+  RB_FN(erase_balance)(tree, parent RB_AUG_ARG);
+}
+
+#undef RB_NODE
+#undef RB_TREE
+#undef RB_FN
+#undef RB_NIL
+#undef RB_SET_ROOT
+#undef RB_CHILD
+#undef RB_SET_CHILD
+#undef RB_PARENT
+#undef RB_SET_PARENT
+#undef RB_COLOR
+#undef RB_SET_COLOR
+#undef RB_AUG_PARAM
+#undef RB_AUG_ARG
+#undef RB_AUG_ROTATE
+#undef RB_AUG_COPY
+#undef RB_AUG_PROPAGATE
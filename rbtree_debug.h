@@ -118,6 +118,15 @@ visualize(t_rbnode* root, int depth, int left)
   }
 }
 
+// the sentinel is shared between trees and must never be written.
+static inline void
+nil_sanitizer(void)
+{
+  assert(rb_nil_node.pc.parent == &rb_nil_node);
+  assert(rb_nil_node.left == &rb_nil_node);
+  assert(rb_nil_node.right == &rb_nil_node);
+}
+
 static inline void
 r4_sanitizer(t_rbnode* root)
 {
@@ -0,0 +1,150 @@
+/*
+ * rbtree_generate.h
+ *
+ * Type-specialized red-black tree functions, in the style of BSD RB_GENERATE.
+ * The generated descents compare keys directly instead of calling
+ * t_less/t_compare through a pointer, which matters most for integer keys
+ * such as vruntime. Linking, rebalancing and erasing use rbtree_write.c.
+ */
+
+#ifndef RBTREE_GENERATE_H
+# define RBTREE_GENERATE_H
+
+#include "rbtree.h"
+#include "rbtree_tools.h"
+
+#define RB_KEY_LESS(a, b) ((a) < (b))
+
+/*
+ * RB_GENERATE(name, type, field, key_type, key)
+ * @name: prefix of the generated functions
+ * @type: container struct
+ * @field: t_rbnode member of @type
+ * @key_type: type of the key, usually int64_t or uint64_t
+ * @key: key member of @type, compared with <
+ *
+ * generates
+ *   type* name_entry(const t_rbnode* node);
+ *   void  name_insert(t_rbtree* tree, type* elm);
+ *   void  name_erase(t_rbtree* tree, type* elm);
+ *   type* name_find(const t_rbtree* tree, key_type key);
+ *   type* name_lower_bound(const t_rbtree* tree, key_type key);
+ *
+ * equal keys are inserted after the existing ones.
+ */
+#define RB_GENERATE(name, type, field, key_type, key) \
+  RB_GENERATE_LESS(name, type, field, key_type, key, RB_KEY_LESS)
+
+/*
+ * same as RB_GENERATE, ordering keys with @less(a, b), a macro or inline function.
+ * e.g. a wrap-safe vruntime order: #define vruntime_before(a, b) ((int64_t)((a) - (b)) < 0)
+ */
+#define RB_GENERATE_LESS(name, type, field, key_type, key, less) \
+\
+static inline type* \
+name##_entry(const t_rbnode* node) \
+{ \
+  return (type*)((uintptr_t)node - offsetof(type, field)); \
+} \
+\
+static inline void \
+name##_insert(t_rbtree* tree, type* elm) \
+{ \
+  t_rbnode**  link = &tree->root; \
+  t_rbnode*   parent = &rb_nil_node; \
+\
+  while (*link != &rb_nil_node) { \
+    parent = *link; \
+    link = &parent->child[!less(elm->key, name##_entry(parent)->key)]; \
+  } \
+  rb_insert_at(tree, &elm->field, parent, link); \
+} \
+\
+static inline void \
+name##_erase(t_rbtree* tree, type* elm) \
+{ \
+  rb_erase(tree, &elm->field); \
+} \
+\
+static inline type* \
+name##_find(const t_rbtree* tree, key_type k) \
+{ \
+  t_rbnode* cur = tree->root; \
+\
+  while (cur != &rb_nil_node) { \
+    type* elm = name##_entry(cur); \
+    bool  gt = less(elm->key, k); \
+    if (!gt && !less(k, elm->key)) \
+      return elm; \
+    cur = cur->child[gt]; \
+  } \
+  return NULL; \
+} \
+\
+static inline type* \
+name##_lower_bound(const t_rbtree* tree, key_type k) \
+{ \
+  t_rbnode* cur = tree->root; \
+  t_rbnode* result = NULL; \
+\
+  while (cur != &rb_nil_node) { \
+    bool dir = less(name##_entry(cur)->key, k); \
+    result = dir ? result : cur; \
+    cur = cur->child[dir]; \
+  } \
+  return result ? name##_entry(result) : NULL; \
+}
+
+/*
+ * RB_GENERATE_AUGMENT(name, type, field, aug_field, compute)
+ * @name: name of the generated t_rbaugment
+ * @type: container struct
+ * @field: t_rbnode member of @type
+ * @aug_field: per-subtree data member of @type, compared with ==
+ * @compute: function returning @aug_field of an element from the element
+ *           and the @aug_field of its children, e.g. the maximum of a value
+ *
+ * generates
+ *   const t_rbaugment name;
+ * for rb_insert_augmented and rb_erase_augmented.
+ * propagation stops at the first node whose data does not change.
+ */
+#define RB_GENERATE_AUGMENT(name, type, field, aug_field, compute) \
+\
+static inline void \
+name##_propagate(t_rbnode* node, t_rbnode* stop) \
+{ \
+  while (node != stop) { \
+    type* elm = (type*)((uintptr_t)node - offsetof(type, field)); \
+    __typeof__(elm->aug_field) value = compute(elm); \
+    if (elm->aug_field == value) \
+      break; \
+    elm->aug_field = value; \
+    node = get_parent(node); \
+  } \
+} \
+\
+static inline void \
+name##_copy(t_rbnode* old, t_rbnode* new_node) \
+{ \
+  type* o = (type*)((uintptr_t)old - offsetof(type, field)); \
+  type* n = (type*)((uintptr_t)new_node - offsetof(type, field)); \
+\
+  n->aug_field = o->aug_field; \
+} \
+\
+static inline void \
+name##_rotate(t_rbnode* old, t_rbnode* new_node) \
+{ \
+  type* o = (type*)((uintptr_t)old - offsetof(type, field)); \
+  type* n = (type*)((uintptr_t)new_node - offsetof(type, field)); \
+\
+  n->aug_field = o->aug_field; \
+  o->aug_field = compute(o); \
+} \
+\
+static const t_rbaugment name = { \
+  name##_propagate, name##_copy, name##_rotate, \
+};
+
+#endif // RBTREE_GENERATE_H
@@ -0,0 +1,298 @@
+/*
+ * rbtree_image.c
+ *
+ * Tree image for files: nodes laid out in one block, each followed by a
+ * fixed size record, and linked by offsets from the node holding the link
+ * rather than by addresses. The image reads the same wherever it is mapped,
+ * so a saved file is mmapped read-only and searched as is, and processes
+ * mapping the same file share its pages.
+ * Nodes are written in preorder, a left child right after its parent.
+ * Offsets are native integers, images are not portable across endianness.
+ */
+#include <fcntl.h>
+#include <stdio.h>    // rename
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rbtree.h"
+#include "rbtree_tools.h"
+
+static const char image_magic[8] = "RBIMG01";
+
+typedef struct rbimage_header
+{
+  char      magic[8];
+  uint64_t  count;
+  uint64_t  slot_size;    // node and record, a multiple of 8
+  uint64_t  record_size;
+  int64_t   root;         // offset from the header, 0 if empty
+} t_rbimage_header;
+
+// a link of 0 is nil, a node never links to itself.
+static inline const t_rbinode*
+follow(const t_rbinode* node, int64_t offset)
+{
+  return offset != 0 ? (const t_rbinode*)((const char*)node + offset) : NULL;
+}
+
+static inline int64_t
+offset_of(const t_rbinode* from, const t_rbinode* to)
+{
+  return to != NULL ? (const char*)to - (const char*)from : 0;
+}
+
+static inline const t_rbinode*
+image_parent(const t_rbinode* node)
+{
+  return follow(node, node->pc & ~(int64_t)1);
+}
+
+static inline const void*
+record_of(const t_rbinode* node)
+{
+  return node + 1;
+}
+
+static inline const t_rbinode*
+node_of(const void* record)
+{
+  return (const t_rbinode*)record - 1;
+}
+
+typedef struct image_writer
+{
+  char*   slots;
+  size_t  slot_size;
+  size_t  next;
+  size_t  record_size;
+  void    (*store)(const t_rbnode*, void*);
+} t_image_writer;
+
+// writes the subtree of @node in preorder and returns its slot.
+static t_rbinode*
+write_subtree(t_image_writer* w, const t_rbnode* node, t_rbinode* parent)
+{
+  t_rbinode* slot;
+
+  if (node == &rb_nil_node)
+    return NULL;
+  slot = (t_rbinode*)(w->slots + w->next++ * w->slot_size);
+  slot->pc = offset_of(slot, parent) | get_color(node);
+  memset(slot + 1, 0, w->slot_size - sizeof(t_rbinode));
+  w->store(node, slot + 1);
+  slot->left = offset_of(slot, write_subtree(w, node->left, slot));
+  slot->right = offset_of(slot, write_subtree(w, node->right, slot));
+  return slot;
+}
+
+/*
+ * @path: file to create or replace
+ * @tree: tree to save, left untouched
+ * @record_size: bytes of user data stored with each node
+ * @store: copies the data of a node into its zeroed record
+ *
+ * the image is built in "@path.tmp", sized first and filled through a shared
+ * mapping without a copy in between, then renamed over @path once on disk.
+ * processes mapping the old image keep it, and a crash leaves no partial
+ * image at @path. the magic is written last, a partial file never has it.
+ * returns false on any I/O error, @path is then unchanged.
+ */
+bool
+rb_image_save(const char* path, t_rbtree* tree, size_t record_size, void (*store)(const t_rbnode*, void*))
+{
+  t_image_writer    w;
+  t_rbimage_header* header;
+  t_rbnode*         node;
+  size_t            count = 0;
+  size_t            length;
+  void*             map;
+  char*             tmp;
+  bool              ok;
+  int               fd;
+
+  for (node = rb_first(tree); node != NULL; node = rb_next(node)) {
+    ++count;
+  }
+  w.slot_size = (sizeof(t_rbinode) + record_size + 7) & ~(size_t)7;
+  w.record_size = record_size;
+  w.next = 0;
+  w.store = store;
+  length = sizeof(t_rbimage_header) + count * w.slot_size;
+
+  tmp = (char*)malloc(strlen(path) + sizeof(".tmp"));
+  if (tmp == NULL)
+    return false;
+  strcpy(tmp, path);
+  strcat(tmp, ".tmp");
+  fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    free(tmp);
+    return false;
+  }
+  map = MAP_FAILED;
+  if (ftruncate(fd, length) == 0)
+    map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ok = map != MAP_FAILED;
+
+  if (ok) {
+    header = (t_rbimage_header*)map;
+    w.slots = (char*)(header + 1);
+    header->count = count;
+    header->slot_size = w.slot_size;
+    header->record_size = record_size;
+    header->root = count ? (int64_t)sizeof(t_rbimage_header) : 0;
+    write_subtree(&w, tree->root, NULL);
+    assert(w.next == count);
+    memcpy(header->magic, image_magic, sizeof(image_magic));
+    ok = msync(map, length, MS_SYNC) == 0;
+    munmap(map, length);
+  }
+  ok = ok && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok)
+    unlink(tmp);
+  free(tmp);
+  return ok;
+}
+
+// the header describes a block of nodes that fits the mapping exactly.
+static bool
+is_valid_header(const t_rbimage_header* header, size_t length)
+{
+  size_t block = length - sizeof(t_rbimage_header);
+
+  if (memcmp(header->magic, image_magic, sizeof(image_magic)) != 0)
+    return false;
+  if (header->slot_size < sizeof(t_rbinode) || header->slot_size % 8 != 0
+      || header->record_size > header->slot_size - sizeof(t_rbinode))
+    return false;
+  // block / slot_size instead of count * slot_size, which may overflow
+  if (block % header->slot_size != 0 || block / header->slot_size != header->count)
+    return false;
+  if (header->count == 0)
+    return header->root == 0;
+  return header->root >= (int64_t)sizeof(t_rbimage_header)
+    && (uint64_t)header->root < length
+    && (header->root - sizeof(t_rbimage_header)) % header->slot_size == 0;
+}
+
+/*
+ * @image: image to map
+ * @path: file written by rb_image_save
+ *
+ * maps the file read-only, nothing is read until searched.
+ * returns false if the file cannot be mapped or is not an image.
+ * only the header is checked, the links of the nodes are trusted.
+ */
+bool
+rb_image_open(t_rbimage* image, const char* path)
+{
+  const t_rbimage_header* header;
+  struct stat             st;
+  void*                   map;
+  int                     fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(t_rbimage_header)) {
+    close(fd);
+    return false;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  header = (const t_rbimage_header*)map;
+  if (!is_valid_header(header, st.st_size)) {
+    munmap(map, st.st_size);
+    return false;
+  }
+  image->base = (const char*)map;
+  image->length = st.st_size;
+  image->root = header->root ? (const t_rbinode*)(image->base + header->root) : NULL;
+  image->count = header->count;
+  image->record_size = header->record_size;
+  return true;
+}
+
+void
+rb_image_close(t_rbimage* image)
+{
+  if (image->base != NULL)
+    munmap((void*)image->base, image->length);
+  image->base = NULL;
+  image->root = NULL;
+  image->count = 0;
+}
+
+// record of a node equal to @key, NULL if none.
+const void*
+rb_image_find(const t_rbimage* image, const void* key, t_pcompare cmp)
+{
+  const t_rbinode* cur = image->root;
+
+  while (cur != NULL) {
+    int cmp_ret = cmp(key, record_of(cur));
+    if (cmp_ret == 0)
+      return record_of(cur);
+    cur = follow(cur, cmp_ret > 0 ? cur->right : cur->left);
+  }
+  return NULL;
+}
+
+// record of the first node not less than @key, NULL if none.
+const void*
+rb_image_lower_bound(const t_rbimage* image, const void* key, t_pcompare cmp)
+{
+  const t_rbinode* cur = image->root;
+  const t_rbinode* result = NULL;
+
+  while (cur != NULL) {
+    bool dir = cmp(key, record_of(cur)) > 0;
+
+    result = dir ? result : cur;
+    cur = follow(cur, dir ? cur->right : cur->left);
+  }
+  return result != NULL ? record_of(result) : NULL;
+}
+
+const void*
+rb_image_first(const t_rbimage* image)
+{
+  const t_rbinode* node = image->root;
+
+  if (node == NULL)
+    return NULL;
+  while (node->left != 0) {
+    node = follow(node, node->left);
+  }
+  return record_of(node);
+}
+
+// in-order next record through the parent links, NULL at the end.
+const void*
+rb_image_next(const void* record)
+{
+  const t_rbinode* node = node_of(record);
+  const t_rbinode* parent;
+
+  if (node->right != 0) {
+    node = follow(node, node->right);
+    while (node->left != 0) {
+      node = follow(node, node->left);
+    }
+    return record_of(node);
+  }
+  for (parent = image_parent(node); parent != NULL; parent = image_parent(parent)) {
+    if (follow(parent, parent->left) == node)
+      return record_of(parent);
+    node = parent;
+  }
+  return NULL;
+}
@@ -0,0 +1,151 @@
+/*
+ * rbtree_index.c
+ *
+ * Red-black tree of 12 byte nodes linked by 32-bit positions in one array.
+ * nodes[0] is the nil node, so position 0 doubles as "none".
+ * Nothing points into the array, so it can be moved or copied with memcpy
+ * as long as tree->nodes follows. Keys live in a parallel int64_t array.
+ * Balancing is the rbtree_balance.h code shared with rbtree_write.c.
+ */
+#include "rbtree.h"
+#include "rbtree_tools.h"
+
+static inline uint32_t
+index_of(const t_rbtree32* tree, const t_rbnode32* node)
+{
+  return (uint32_t)(node - tree->nodes);
+}
+
+static inline void
+set_parent32(t_rbtree32* tree, t_rbnode32* node, t_rbnode32* parent)
+{
+  assert(node != tree->nodes);
+  node->pc = index_of(tree, parent) << 1 | (node->pc & 1);
+}
+
+static inline void
+set_color32(t_rbtree32* tree, t_rbnode32* node, uint8_t color)
+{
+  assert(!(color == RED && node == tree->nodes));
+  (void)tree;
+  node->pc = (node->pc & ~1u) | color;
+}
+
+#define RB_NODE                   t_rbnode32
+#define RB_TREE                   t_rbtree32
+#define RB_FN(name)               index_##name
+#define RB_NIL                    (tree->nodes)
+#define RB_SET_ROOT(n)            (tree->root = index_of(tree, n))
+#define RB_CHILD(n, dir)          (tree->nodes + (n)->child[dir])
+#define RB_SET_CHILD(n, dir, c)   ((n)->child[dir] = index_of(tree, c))
+#define RB_PARENT(n)              (tree->nodes + ((n)->pc >> 1))
+#define RB_SET_PARENT(n, p)       set_parent32(tree, n, p)
+#define RB_COLOR(n)               ((n)->pc & 1)
+#define RB_SET_COLOR(n, c)        set_color32(tree, n, c)
+#define RB_AUG_PARAM
+#define RB_AUG_ARG
+#define RB_AUG_ROTATE(old, new_node)
+#define RB_AUG_COPY(old, new_node)
+#define RB_AUG_PROPAGATE(parent, successor)
+#include "rbtree_balance.h"
+
+/*
+ * @tree: tree to set up, empty
+ * @nodes: node array, nodes[0] is taken as nil
+ * @keys: keys[i] is the key of nodes[i]
+ */
+void
+rb32_init(t_rbtree32* tree, t_rbnode32* nodes, const int64_t* keys)
+{
+  nodes[0].pc = 0;
+  nodes[0].left = 0;
+  nodes[0].right = 0;
+  tree->nodes = nodes;
+  tree->keys = keys;
+  tree->root = 0;
+}
+
+// links nodes[idx] by keys[idx], equal keys after the existing ones.
+void
+rb32_insert(t_rbtree32* tree, uint32_t idx)
+{
+  t_rbnode32*     nodes = tree->nodes;
+  const int64_t*  keys = tree->keys;
+  int64_t         key = keys[idx];
+  uint32_t*       link = &tree->root;
+  uint32_t        parent = 0;
+
+  assert(idx != 0 && idx < (uint32_t)1 << 31);
+  while (*link != 0) {
+    parent = *link;
+    if (key < keys[parent])
+      link = &nodes[parent].left;
+    else
+      link = &nodes[parent].right;
+  }
+  nodes[idx].pc = parent << 1 | RED;
+  nodes[idx].left = 0;
+  nodes[idx].right = 0;
+  *link = idx;
+  index_insert_balance(tree, nodes + idx);
+}
+
+void
+rb32_erase(t_rbtree32* tree, uint32_t idx)
+{
+  if (idx != 0)
+    index_erase_node(tree, tree->nodes + idx);
+}
+
+// position of a node with @key, 0 if none.
+uint32_t
+rb32_find(const t_rbtree32* tree, int64_t key)
+{
+  const t_rbnode32* nodes = tree->nodes;
+  const int64_t*    keys = tree->keys;
+  uint32_t          cur = tree->root;
+
+  while (cur != 0) {
+    if (key < keys[cur])
+      cur = nodes[cur].left;
+    else if (keys[cur] < key)
+      cur = nodes[cur].right;
+    else
+      return cur;
+  }
+  return 0;
+}
+
+uint32_t
+rb32_first(const t_rbtree32* tree)
+{
+  uint32_t cur = tree->root;
+
+  if (cur == 0) return 0;
+
+  while (tree->nodes[cur].left != 0) {
+    cur = tree->nodes[cur].left;
+  }
+  return cur;
+}
+
+uint32_t
+rb32_next(const t_rbtree32* tree, uint32_t idx)
+{
+  const t_rbnode32* nodes = tree->nodes;
+  uint32_t          parent;
+
+  if (nodes[idx].right != 0) {
+    idx = nodes[idx].right;
+    while (nodes[idx].left != 0) {
+      idx = nodes[idx].left;
+    }
+    return idx;
+  }
+  for (parent = nodes[idx].pc >> 1; parent != 0; parent = nodes[parent].pc >> 1) {
+    if (nodes[parent].left == idx)
+      return parent;
+    idx = parent;
+  }
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * rbtree_interval.c
+ *
+ * Interval tree: intervals ordered by start, every node keeping the largest
+ * last of its subtree through the augment callbacks of rbtree_write.c.
+ *
+ * reference
+ * https://elixir.bootlin.com/linux/latest/source/include/linux/interval_tree_generic.h
+ */
+#include "rbtree.h"
+#include "rbtree_generate.h"
+
+static inline t_rbinterval*
+interval_entry(const t_rbnode* node)
+{
+  return (t_rbinterval*)((uintptr_t)node - offsetof(t_rbinterval, node));
+}
+
+static inline int64_t
+interval_compute(const t_rbinterval* interval)
+{
+  int64_t max = interval->last;
+
+  if (interval->node.left != rb_nil && interval_entry(interval->node.left)->subtree_last > max)
+    max = interval_entry(interval->node.left)->subtree_last;
+  if (interval->node.right != rb_nil && interval_entry(interval->node.right)->subtree_last > max)
+    max = interval_entry(interval->node.right)->subtree_last;
+  return max;
+}
+
+RB_GENERATE_AUGMENT(interval_augment, t_rbinterval, node, subtree_last, interval_compute)
+
+static bool
+interval_less(t_rbnode* n1, const t_rbnode* n2)
+{
+  return interval_entry(n1)->start < interval_entry(n2)->start;
+}
+
+/*
+ * @tree: interval tree to insert in
+ * @interval: node with start and last set, start <= last
+ */
+void
+interval_insert(t_rbtree* tree, t_rbinterval* interval)
+{
+  rb_insert_augmented(tree, &interval->node, interval_less, &interval_augment);
+}
+
+void
+interval_erase(t_rbtree* tree, t_rbinterval* interval)
+{
+  rb_erase_augmented(tree, &interval->node, &interval_augment);
+}
+
+/*
+ * leftmost node of the subtree of @interval overlapping [start, last].
+ * the subtree must have subtree_last >= start.
+ */
+static t_rbinterval*
+subtree_search(t_rbinterval* interval, int64_t start, int64_t last)
+{
+  while (true) {
+    // a left subtree reaching start holds the leftmost candidates
+    if (interval->node.left != rb_nil) {
+      t_rbinterval* left = interval_entry(interval->node.left);
+      if (start <= left->subtree_last) {
+        interval = left;
+        continue;
+      }
+    }
+    // everything on the right starts after interval->start
+    if (interval->start > last)
+      return NULL;
+    if (start <= interval->last)
+      return interval;
+    if (interval->node.right == rb_nil)
+      return NULL;
+    interval = interval_entry(interval->node.right);
+    if (start > interval->subtree_last)
+      return NULL;
+  }
+}
+
+/*
+ * @tree: interval tree
+ * @start, @last: closed query range
+ *
+ * returns the overlapping interval with the smallest start, NULL if none.
+ * with interval_iter_next every hit is visited in order of start without
+ * allocation. subtrees ending before @start or starting after @last are
+ * never entered, so k hits cost O(log n + k log(n / k)) at worst.
+ */
+t_rbinterval*
+interval_iter_first(const t_rbtree* tree, int64_t start, int64_t last)
+{
+  t_rbinterval* root;
+
+  if (tree->root == rb_nil)
+    return NULL;
+  root = interval_entry(tree->root);
+  if (root->subtree_last < start)
+    return NULL;
+  return subtree_search(root, start, last);
+}
+
+// next interval after @interval overlapping [start, last], NULL if none.
+t_rbinterval*
+interval_iter_next(t_rbinterval* interval, int64_t start, int64_t last)
+{
+  t_rbnode* node = &interval->node;
+  t_rbnode* right = node->right;
+  t_rbnode* prev;
+
+  while (true) {
+    // the right subtree comes first in order
+    if (right != rb_nil && start <= interval_entry(right)->subtree_last)
+      return subtree_search(interval_entry(right), start, last);
+
+    // go up until coming from a left child
+    do {
+      prev = node;
+      node = rb_parent(node);
+      if (node == rb_nil)
+        return NULL;
+      right = node->right;
+    } while (prev == right);
+
+    interval = interval_entry(node);
+    if (last < interval->start)
+      return NULL;
+    if (start <= interval->last)
+      return interval;
+  }
+}
@@ -0,0 +1,540 @@
+/*
+ * rbtree_join.c
+ *
+ * Join and split of red-black trees, range erase and join-based set operations.
+ *
+ * reference
+ * Blelloch, Ferizovic, Sun. Just Join for Parallel Ordered Sets. SPAA 2016.
+ */
+#include <pthread.h>
+#include <unistd.h>   // sysconf
+
+#include "rbtree.h"
+#include "rbtree_tools.h"
+
+#ifdef RB_DEBUG
+# include "rbtree_debug.h"
+# define DEBUG_FUNCTIONS(tree) \
+  nil_sanitizer(); \
+  r4_sanitizer((tree)->root); \
+  r5_sanitizer((tree)->root);
+#else
+# define DEBUG_FUNCTIONS(tree)
+#endif
+
+/*
+ * Subtrees handled here are detached: the root has rb_nil as parent and is black.
+ * Their black height counts the black nodes from the root down to a leaf,
+ * root included and nil excluded, and is passed along so that join never
+ * has to walk a spine to measure it.
+ */
+
+// a key given as t_compare key or as a node ordered by t_less.
+typedef struct rbkey
+{
+  const void* key;
+  t_compare   cmp;
+  t_rbnode*   node;
+  t_less      less;
+} t_rbkey;
+
+typedef enum setop_kind
+{
+  SET_UNION,
+  SET_INTERSECTION,
+  SET_DIFFERENCE,
+} t_setop_kind;
+
+typedef struct setop
+{
+  t_setop_kind  kind;
+  t_less        less;
+  void          (*drop)(t_rbnode*);
+  int           max_depth;    // parallel_depth when the operation started
+} t_setop;
+
+typedef struct setop_arg
+{
+  const t_setop*  op;
+  t_rbnode*       t1;
+  int             bh1;
+  t_rbnode*       t2;
+  int             bh2;
+  int             depth;
+  t_rbnode*       result;
+  int             bh;
+} t_setop_arg;
+
+// recursion levels that fork a thread. 2^depth threads run at most.
+// -1 until set, accessed atomically since any thread may set or read it.
+static int  parallel_depth = -1;
+
+// subtrees with a smaller black height are too small to be worth a thread.
+static const int  parallel_min_bh = 8;
+
+static int
+black_height(t_rbnode* root)
+{
+  int bh = 0;
+
+  for (; root != rb_nil; root = root->left) {
+    bh += get_color(root) == BLACK;
+  }
+  return bh;
+}
+
+// makes @root the root of a detached subtree. @bh grows if a red root is blackened.
+static t_rbnode*
+detach(t_rbnode* root, int* bh)
+{
+  if (root != rb_nil) {
+    set_parent(root, rb_nil);
+    if (get_color(root) == RED) {
+      set_color(root, BLACK);
+      ++*bh;
+    }
+  }
+  return root;
+}
+
+// sign of key - node
+static int
+key_compare(const t_rbkey* key, t_rbnode* node)
+{
+  if (key->cmp != NULL)
+    return key->cmp(key->key, node);
+  if (key->less(key->node, node))
+    return -1;
+  return key->less(node, key->node);
+}
+
+/*
+ * @l, @r: detached subtrees, every node of @l <= @k <= every node of @r
+ * @k: unlinked pivot node
+ * @bh: black height of the result
+ *
+ * the taller tree is walked down its inner spine to the black node as tall as
+ * the shorter tree, which is replaced by @k holding both, as in an insertion.
+ * costs O(|lbh - rbh| + 1).
+ */
+static t_rbnode*
+join(t_rbnode* l, int lbh, t_rbnode* k, t_rbnode* r, int rbh, int* bh)
+{
+  t_rbtree  tree;
+  t_rbnode* parent = rb_nil;
+  t_rbnode* cur;
+  int       h;
+  bool      left = lbh < rbh;
+
+  if (lbh == rbh) {
+    k->pc.parent = rb_nil;
+    k->pc.color = BLACK;
+    k->left = l;
+    k->right = r;
+    set_child_parent(l, k);
+    set_child_parent(r, k);
+    *bh = lbh + 1;
+    return k;
+  }
+
+  tree.root = left ? r : l;
+  cur = tree.root;
+  h = left ? rbh : lbh;
+  while (!(get_color(cur) == BLACK && h == (left ? lbh : rbh))) {
+    h -= get_color(cur) == BLACK;
+    parent = cur;
+    cur = cur->child[!left];
+  }
+
+  k->pc.parent = parent;
+  k->pc.color = RED;
+  if (left) {
+    k->left = l;
+    k->right = cur;
+    parent->left = k;
+  } else {
+    k->left = cur;
+    k->right = r;
+    parent->right = k;
+  }
+  set_child_parent(k->left, k);
+  set_child_parent(k->right, k);
+  *bh = (left ? rbh : lbh) + rb_insert_balance(&tree, k);
+  return tree.root;
+}
+
+// join without a pivot: the minimum of @r is taken out and used as one.
+static t_rbnode*
+join2(t_rbnode* l, int lbh, t_rbnode* r, int rbh, int* bh)
+{
+  t_rbtree  tree = {r};
+  t_rbnode* pivot;
+
+  if (r == rb_nil) {
+    *bh = lbh;
+    return l;
+  }
+  pivot = r;
+  while (pivot->left != rb_nil) {
+    pivot = pivot->left;
+  }
+  rb_erase(&tree, pivot);
+  rbh = black_height(tree.root);
+  return join(l, lbh, pivot, tree.root, rbh, bh);
+}
+
+/*
+ * splits the detached subtree @root into nodes less than @key and the rest.
+ * if @extract, a node equal to @key is taken out and returned instead of
+ * being put in @ge. costs O(log n) since the joins telescope.
+ */
+static t_rbnode*
+split(t_rbnode* root, int bh, const t_rbkey* key, bool extract,
+      t_rbnode** lt, int* ltbh, t_rbnode** ge, int* gebh)
+{
+  t_rbnode* l;
+  t_rbnode* r;
+  t_rbnode* sub;
+  t_rbnode* found;
+  int       lbh;
+  int       rbh;
+  int       subbh;
+  int       cmp_ret;
+
+  if (root == rb_nil) {
+    *lt = rb_nil;
+    *ge = rb_nil;
+    *ltbh = 0;
+    *gebh = 0;
+    return NULL;
+  }
+  // the root is black, so both children are one black node shorter.
+  lbh = bh - 1;
+  rbh = bh - 1;
+  l = detach(root->left, &lbh);
+  r = detach(root->right, &rbh);
+
+  cmp_ret = key_compare(key, root);
+  if (cmp_ret == 0 && extract) {
+    *lt = l;
+    *ltbh = lbh;
+    *ge = r;
+    *gebh = rbh;
+    return root;
+  }
+  if (cmp_ret > 0) {
+    found = split(r, rbh, key, extract, &sub, &subbh, ge, gebh);
+    *lt = join(l, lbh, root, sub, subbh, ltbh);
+  } else {
+    found = split(l, lbh, key, extract, lt, ltbh, &sub, &subbh);
+    *ge = join(sub, subbh, root, r, rbh, gebh);
+  }
+  return found;
+}
+
+static void
+drop_node(const t_setop* op, t_rbnode* node)
+{
+  if (op->drop != NULL)
+    op->drop(node);
+}
+
+static void
+drop_tree(const t_setop* op, t_rbnode* root)
+{
+  if (op->drop != NULL)
+    rb_postorder_foreach(root, op->drop);
+}
+
+static void*  setop_thread(void* arg);
+
+/*
+ * the root of @t1 splits @t2, then both sides recurse, the left one on a new
+ * thread near the top of large trees, and the results are joined back.
+ * on a tie the node of @t1 is kept.
+ */
+static t_rbnode*
+setop(const t_setop* op, t_rbnode* t1, int bh1, t_rbnode* t2, int bh2, int depth, int* bh)
+{
+  t_rbkey     key = {NULL, NULL, t1, op->less};
+  t_setop_arg left;
+  t_rbnode*   k = t1;
+  t_rbnode*   r1;
+  t_rbnode*   r2;
+  t_rbnode*   right;
+  t_rbnode*   dup;
+  int         r1bh;
+  int         r2bh;
+  int         rightbh;
+  pthread_t   thread;
+  bool        forked = false;
+
+  if (t1 == rb_nil || t2 == rb_nil) {
+    if (op->kind == SET_UNION) {
+      *bh = t1 == rb_nil ? bh2 : bh1;
+      return t1 == rb_nil ? t2 : t1;
+    }
+    if (op->kind == SET_DIFFERENCE) {
+      drop_tree(op, t2);
+      *bh = bh1;
+      return t1;
+    }
+    drop_tree(op, t1 == rb_nil ? t2 : t1);
+    *bh = 0;
+    return rb_nil;
+  }
+
+  left.op = op;
+  left.bh1 = bh1 - 1;
+  r1bh = bh1 - 1;
+  left.t1 = detach(k->left, &left.bh1);
+  r1 = detach(k->right, &r1bh);
+  dup = split(t2, bh2, &key, true, &left.t2, &left.bh2, &r2, &r2bh);
+  left.depth = depth + 1;
+
+  if (depth < op->max_depth && bh1 >= parallel_min_bh && bh2 >= parallel_min_bh) {
+    forked = pthread_create(&thread, NULL, setop_thread, &left) == 0;
+  }
+  if (forked == false) {
+    setop_thread(&left);
+  }
+  right = setop(op, r1, r1bh, r2, r2bh, depth + 1, &rightbh);
+  if (forked) {
+    pthread_join(thread, NULL);
+  }
+
+  if (op->kind == SET_UNION || (op->kind == SET_INTERSECTION) == (dup != NULL)) {
+    if (dup != NULL)
+      drop_node(op, dup);
+    return join(left.result, left.bh, k, right, rightbh, bh);
+  }
+  drop_node(op, k);
+  if (dup != NULL)
+    drop_node(op, dup);
+  return join2(left.result, left.bh, right, rightbh, bh);
+}
+
+static void*
+setop_thread(void* arg)
+{
+  t_setop_arg* a = (t_setop_arg*)arg;
+
+  a->result = setop(a->op, a->t1, a->bh1, a->t2, a->bh2, a->depth, &a->bh);
+  return NULL;
+}
+
+// smallest depth with at least @nthreads leaves.
+static int
+depth_for_threads(int nthreads)
+{
+  int depth = 0;
+
+  while ((1 << depth) < nthreads) {
+    ++depth;
+  }
+  return depth;
+}
+
+static void
+run_setop(t_setop_kind kind, t_rbtree* t1, t_rbtree* t2, t_less less, void (*drop)(t_rbnode*))
+{
+  t_setop op = {kind, less, drop, __atomic_load_n(&parallel_depth, __ATOMIC_RELAXED)};
+  int     bh;
+
+  if (op.max_depth < 0) {
+    // the first call sets the default, unless rb_set_threads got there first
+    int expected = -1;
+
+    op.max_depth = depth_for_threads((int)sysconf(_SC_NPROCESSORS_ONLN));
+    if (!__atomic_compare_exchange_n(&parallel_depth, &expected, op.max_depth, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      op.max_depth = expected;
+  }
+  t1->root = setop(&op, t1->root, black_height(t1->root), t2->root, black_height(t2->root), 0, &bh);
+  t2->root = rb_nil;
+  DEBUG_FUNCTIONS(t1);
+}
+
+/*
+ * @nthreads: upper bound of threads used by rb_union, rb_intersection and rb_difference.
+ * defaults to the number of online CPUs.
+ */
+void
+rb_set_threads(int nthreads)
+{
+  __atomic_store_n(&parallel_depth, depth_for_threads(nthreads), __ATOMIC_RELAXED);
+}
+
+/*
+ * @t1: tree whose nodes are all less than or equal to @pivot, holds the result
+ * @pivot: node not in either tree
+ * @t2: tree whose nodes are all greater than or equal to @pivot, emptied
+ */
+void
+rb_join(t_rbtree* t1, t_rbnode* pivot, t_rbtree* t2)
+{
+  int lbh = black_height(t1->root);
+  int rbh = black_height(t2->root);
+  int bh;
+
+  t1->root = join(t1->root, lbh, pivot, t2->root, rbh, &bh);
+  t2->root = rb_nil;
+  DEBUG_FUNCTIONS(t1);
+}
+
+/*
+ * @tree: tree to split, emptied unless it is @lt or @ge
+ * @lt: receives the nodes less than @key
+ * @ge: receives the nodes greater than or equal to @key
+ */
+void
+rb_split(t_rbtree* tree, const void* key, t_compare cmp, t_rbtree* lt, t_rbtree* ge)
+{
+  t_rbkey   k = {key, cmp, NULL, NULL};
+  t_rbnode* root = tree->root;
+  t_rbnode* ltroot;
+  t_rbnode* geroot;
+  int       ltbh;
+  int       gebh;
+
+  tree->root = rb_nil;
+  split(root, black_height(root), &k, false, &ltroot, &ltbh, &geroot, &gebh);
+  lt->root = ltroot;
+  ge->root = geroot;
+  DEBUG_FUNCTIONS(lt);
+  DEBUG_FUNCTIONS(ge);
+}
+
+/*
+ * hands the nodes of the detached subtree @root to @cb in order, in O(n).
+ * a left child is rotated above its parent until the top has none, so every
+ * node is passed on exactly once and never read after @cb, which may free it.
+ */
+static void
+hand_back(t_rbnode* root, void (*cb)(t_rbnode*))
+{
+  t_rbnode* node = root;
+  t_rbnode* next;
+
+  if (cb == NULL)
+    return;
+  while (node != rb_nil) {
+    if (node->left != rb_nil) {
+      next = node->left;
+      node->left = next->right;
+      next->right = node;
+    } else {
+      next = node->right;
+      cb(node);
+    }
+    node = next;
+  }
+}
+
+// splits off [@lo, @hi) and joins the rest. tells whether either side is empty.
+static t_rbnode*
+cut_range(t_rbtree* tree, const void* lo, const void* hi, t_compare cmp, bool* lt_empty, bool* rest_empty)
+{
+  t_rbkey   lo_key = {lo, cmp, NULL, NULL};
+  t_rbkey   hi_key = {hi, cmp, NULL, NULL};
+  t_rbnode* lt;
+  t_rbnode* ge;
+  t_rbnode* range;
+  t_rbnode* rest;
+  int       ltbh;
+  int       gebh;
+  int       rangebh;
+  int       restbh;
+  int       bh;
+
+  split(tree->root, black_height(tree->root), &lo_key, false, &lt, &ltbh, &ge, &gebh);
+  split(ge, gebh, &hi_key, false, &range, &rangebh, &rest, &restbh);
+  *lt_empty = lt == rb_nil;
+  *rest_empty = rest == rb_nil;
+  tree->root = join2(lt, ltbh, rest, restbh, &bh);
+  DEBUG_FUNCTIONS(tree);
+  return range;
+}
+
+/*
+ * @tree: tree to erase from
+ * @lo, @hi: keys of the half-open range [lo, hi) for @cmp
+ * @cb: receives the erased nodes in order, may be NULL
+ *
+ * the range is split off and the two remaining trees are joined once,
+ * so k erased nodes cost O(k + log n) with no per-node rebalancing,
+ * or O(log n) if @cb is NULL and the nodes are simply dropped.
+ */
+void
+rb_erase_range(t_rbtree* tree, const void* lo, const void* hi, t_compare cmp, void (*cb)(t_rbnode*))
+{
+  bool lt_empty;
+  bool rest_empty;
+
+  hand_back(cut_range(tree, lo, hi, cmp, &lt_empty, &rest_empty), cb);
+}
+
+/*
+ * rb_erase_range keeping the cached ends. the minimum survives if the part
+ * before @lo is not empty, the maximum if the part from @hi is not, otherwise
+ * the new end is found in the joined tree.
+ */
+void
+rb_erase_range_cached(t_rbtree_cached* tree, const void* lo, const void* hi, t_compare cmp, void (*cb)(t_rbnode*))
+{
+  t_rbnode* range;
+  bool      lt_empty;
+  bool      rest_empty;
+
+  range = cut_range(&tree->rbtree, lo, hi, cmp, &lt_empty, &rest_empty);
+  if (lt_empty)
+    tree->leftmost_node = rb_first(&tree->rbtree);
+  if (rest_empty)
+    tree->rightmost_node = rb_last(&tree->rbtree);
+  hand_back(range, cb);
+}
+
+// empties @tree in one pass, handing every node to @cb in order.
+void
+rb_clear(t_rbtree* tree, void (*cb)(t_rbnode*))
+{
+  t_rbnode* root = tree->root;
+
+  tree->root = rb_nil;
+  hand_back(root, cb);
+}
+
+void
+rb_clear_cached(t_rbtree_cached* tree, void (*cb)(t_rbnode*))
+{
+  tree->leftmost_node = NULL;
+  tree->rightmost_node = NULL;
+  rb_clear(&tree->rbtree, cb);
+}
+
+/*
+ * Set operations on trees with unique keys. The result is left in @t1 and
+ * @t2 is emptied. Nodes that are not part of the result are passed to @drop,
+ * which may be NULL and may be called from several threads at once.
+ */
+
+// nodes of both trees, keeping the node of @t1 for keys in both.
+void
+rb_union(t_rbtree* t1, t_rbtree* t2, t_less less, void (*drop)(t_rbnode*))
+{
+  run_setop(SET_UNION, t1, t2, less, drop);
+}
+
+// nodes of @t1 whose key is also in @t2.
+void
+rb_intersection(t_rbtree* t1, t_rbtree* t2, t_less less, void (*drop)(t_rbnode*))
+{
+  run_setop(SET_INTERSECTION, t1, t2, less, drop);
+}
+
+// nodes of @t1 whose key is not in @t2.
+void
+rb_difference(t_rbtree* t1, t_rbtree* t2, t_less less, void (*drop)(t_rbnode*))
+{
+  run_setop(SET_DIFFERENCE, t1, t2, less, drop);
+}
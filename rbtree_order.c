@@ -0,0 +1,127 @@
+/*
+ * rbtree_order.c
+ *
+ * Order-statistic tree: every node counts the nodes of its subtree,
+ * kept up to date by the augment callbacks of rbtree_write.c.
+ *
+ * reference
+ * Cormen et al. Introduction to Algorithms, 14.1 Dynamic order statistics.
+ */
+#include "rbtree.h"
+#include "rbtree_tools.h"
+
+static inline t_rbnode_os*
+os_entry(const t_rbnode* node)
+{
+  return (t_rbnode_os*)((uintptr_t)node - offsetof(t_rbnode_os, node));
+}
+
+static inline size_t
+subtree_size(const t_rbnode* node)
+{
+  return node == &rb_nil_node ? 0 : os_entry(node)->size;
+}
+
+static inline size_t
+compute_size(const t_rbnode* node)
+{
+  return subtree_size(node->left) + subtree_size(node->right) + 1;
+}
+
+// every size on the path changes, so there is no early stop.
+static void
+size_propagate(t_rbnode* node, t_rbnode* stop)
+{
+  while (node != stop) {
+    os_entry(node)->size = compute_size(node);
+    node = get_parent(node);
+  }
+}
+
+static void
+size_copy(t_rbnode* old, t_rbnode* new_node)
+{
+  os_entry(new_node)->size = os_entry(old)->size;
+}
+
+static void
+size_rotate(t_rbnode* old, t_rbnode* new_node)
+{
+  os_entry(new_node)->size = os_entry(old)->size;
+  os_entry(old)->size = compute_size(old);
+}
+
+static const t_rbaugment  size_augment = {
+  size_propagate, size_copy, size_rotate,
+};
+
+void
+rb_os_insert(t_rbtree_os* tree, t_rbnode_os* node, t_less less)
+{
+  rb_insert_augmented(&tree->rbtree, &node->node, less, &size_augment);
+}
+
+void
+rb_os_erase(t_rbtree_os* tree, t_rbnode_os* node)
+{
+  rb_erase_augmented(&tree->rbtree, &node->node, &size_augment);
+}
+
+/*
+ * @tree: order-statistic tree
+ * @rank: 0 based position in order
+ *
+ * returns the node with @rank nodes before it, NULL if out of range.
+ */
+t_rbnode_os*
+rb_select(const t_rbtree_os* tree, size_t rank)
+{
+  t_rbnode* cur = tree->rbtree.root;
+
+  while (cur != &rb_nil_node) {
+    size_t left = subtree_size(cur->left);
+
+    if (rank < left) {
+      cur = cur->left;
+    } else if (rank > left) {
+      rank -= left + 1;
+      cur = cur->right;
+    } else {
+      return os_entry(cur);
+    }
+  }
+  return NULL;
+}
+
+// number of nodes before @node, counted on the way up to the root.
+size_t
+rb_rank(const t_rbnode_os* node)
+{
+  const t_rbnode* cur = &node->node;
+  size_t          rank = subtree_size(cur->left);
+
+  for (t_rbnode* parent = get_parent((t_rbnode*)cur); parent != &rb_nil_node; parent = get_parent(parent)) {
+    if (parent->right == cur)
+      rank += subtree_size(parent->left) + 1;
+    cur = parent;
+  }
+  return rank;
+}
+
+// number of nodes less than @key, the rank rb_lower_bound would return.
+size_t
+rb_count_less(const void* key, const t_rbtree_os* tree, t_compare cmp)
+{
+  t_rbnode* cur = tree->rbtree.root;
+  size_t    count = 0;
+
+  while (cur != &rb_nil_node) {
+    if (cmp(key, cur) <= 0) {
+      cur = cur->left;
+    } else {
+      count += subtree_size(cur->left) + 1;
+      cur = cur->right;
+    }
+  }
+  return count;
+}
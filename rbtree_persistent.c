@@ -0,0 +1,544 @@
+/*
+ * rbtree_persistent.c
+ *
+ * Persistent red-black tree: an update copies the nodes on its path and
+ * leaves every other version as it was, so a snapshot is just one more
+ * reference to a root.
+ * Nodes have no parent link, since a subtree may hang under the roots of
+ * many versions, and count the references to them. A node referenced once
+ * belongs to the version being updated alone and is recycled right away;
+ * shared nodes are copied.
+ * Insert is Okasaki's, erase Kahrs', both written as functions from trees
+ * to trees, consuming their arguments.
+ *
+ * reference
+ * Okasaki. Red-black trees in a functional setting. JFP 1999.
+ * Kahrs. Red-black trees with types. JFP 2001.
+ * Driscoll, Sarnak, Sleator, Tarjan. Making data structures persistent. 1989.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "rbtree.h"
+#include "rbtree_tools.h"
+
+/*
+ * nodes given up by an update, taken again by its next allocations.
+ * an update frees about as many nodes as it makes, so unshared paths are
+ * rebuilt without going through malloc. per thread, one writer per version.
+ * a thread that ever kept one frees them when it exits.
+ */
+static __thread t_rbpnode*  spare;
+static __thread int         spare_count;
+static __thread bool        spare_registered;
+static pthread_key_t        spare_key;
+static pthread_once_t       spare_once = PTHREAD_ONCE_INIT;
+
+// kept between updates, the rest goes back to malloc.
+#define RB_P_SPARE_MAX 64
+
+static void
+free_spare(void* unused)
+{
+  (void)unused;
+  while (spare != NULL) {
+    t_rbpnode* node = spare;
+
+    spare = node->child[rb_left];
+    free(node);
+  }
+  spare_count = 0;
+}
+
+static void
+create_spare_key(void)
+{
+  pthread_key_create(&spare_key, free_spare);
+}
+
+// the key only needs a value other than NULL for free_spare to run.
+static void
+register_spare(void)
+{
+  pthread_once(&spare_once, create_spare_key);
+  pthread_setspecific(spare_key, &spare);
+  spare_registered = true;
+}
+
+static inline void
+put_spare(t_rbpnode* node)
+{
+  if (!spare_registered)
+    register_spare();
+  node->child[rb_left] = spare;
+  spare = node;
+  ++spare_count;
+}
+
+static void
+trim_spare(void)
+{
+  while (spare_count > RB_P_SPARE_MAX) {
+    t_rbpnode* node = spare;
+
+    spare = node->child[rb_left];
+    --spare_count;
+    free(node);
+  }
+}
+
+static inline bool
+is_red(const t_rbpnode* node)
+{
+  return node != NULL && node->color == RED;
+}
+
+static inline bool
+is_black(const t_rbpnode* node)
+{
+  return node != NULL && node->color == BLACK;
+}
+
+static inline void
+retain(t_rbpnode* node)
+{
+  if (node != NULL)
+    __atomic_fetch_add(&node->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void
+release(t_rbpnode* node)
+{
+  while (node != NULL && __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    t_rbpnode* right = node->child[rb_right];
+
+    release(node->child[rb_left]);
+    put_spare(node);
+    node = right;
+  }
+}
+
+static inline bool
+is_shared(const t_rbpnode* node)
+{
+  return __atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+/*
+ * consumes the reference to @node and hands out references to its children.
+ * read the item before, the node is gone if it was not shared.
+ */
+static inline void
+open_node(t_rbpnode* node, t_rbpnode** left, t_rbpnode** right)
+{
+  *left = node->child[rb_left];
+  *right = node->child[rb_right];
+  if (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1) {
+    put_spare(node);
+  } else {
+    retain(*left);
+    retain(*right);
+    release(node);
+  }
+}
+
+// consumes the references to @left and @right.
+static inline t_rbpnode*
+make(uint8_t color, t_rbpnode* left, void* item, t_rbpnode* right)
+{
+  t_rbpnode* node = spare;
+
+  if (node != NULL) {
+    spare = node->child[rb_left];
+    --spare_count;
+  } else {
+    node = (t_rbpnode*)malloc(sizeof(t_rbpnode));
+    if (node == NULL)
+      abort();
+  }
+  node->child[rb_left] = left;
+  node->child[rb_right] = right;
+  node->item = item;
+  node->refs = 1;
+  node->color = color;
+  return node;
+}
+
+static t_rbpnode*
+make_black(t_rbpnode* node)
+{
+  t_rbpnode*  left;
+  t_rbpnode*  right;
+  void*       item;
+
+  if (!is_red(node))
+    return node;
+  item = node->item;
+  open_node(node, &left, &right);
+  return make(BLACK, left, item, right);
+}
+
+// black @node turned red, one less black on its paths.
+static t_rbpnode*
+make_red(t_rbpnode* node)
+{
+  t_rbpnode*  left;
+  t_rbpnode*  right;
+  void*       item = node->item;
+
+  assert(is_black(node));
+  open_node(node, &left, &right);
+  return make(RED, left, item, right);
+}
+
+/*
+ * a black node over @a, @x and @b, where one side may have two reds in a row.
+ * those become a red node over two black ones.
+ */
+static t_rbpnode*
+balance(t_rbpnode* a, void* x, t_rbpnode* b)
+{
+  t_rbpnode*  n1;
+  t_rbpnode*  n2;
+  t_rbpnode*  n3;
+  t_rbpnode*  n4;
+  t_rbpnode*  inner;
+  void*       y;
+  void*       z;
+
+  if (is_red(a) && is_red(b)) {
+    y = a->item;
+    z = b->item;
+    open_node(a, &n1, &n2);
+    open_node(b, &n3, &n4);
+    return make(RED, make(BLACK, n1, y, n2), x, make(BLACK, n3, z, n4));
+  }
+  if (is_red(a) && is_red(a->child[rb_left])) {
+    y = a->child[rb_left]->item;
+    z = a->item;
+    open_node(a, &inner, &n3);
+    open_node(inner, &n1, &n2);
+    return make(RED, make(BLACK, n1, y, n2), z, make(BLACK, n3, x, b));
+  }
+  if (is_red(a) && is_red(a->child[rb_right])) {
+    y = a->item;
+    z = a->child[rb_right]->item;
+    open_node(a, &n1, &inner);
+    open_node(inner, &n2, &n3);
+    return make(RED, make(BLACK, n1, y, n2), z, make(BLACK, n3, x, b));
+  }
+  if (is_red(b) && is_red(b->child[rb_right])) {
+    y = b->item;
+    z = b->child[rb_right]->item;
+    open_node(b, &n1, &inner);
+    open_node(inner, &n2, &n3);
+    return make(RED, make(BLACK, a, x, n1), y, make(BLACK, n2, z, n3));
+  }
+  if (is_red(b) && is_red(b->child[rb_left])) {
+    y = b->child[rb_left]->item;
+    z = b->item;
+    open_node(b, &inner, &n3);
+    open_node(inner, &n1, &n2);
+    return make(RED, make(BLACK, a, x, n1), y, make(BLACK, n2, z, n3));
+  }
+  return make(BLACK, a, x, b);
+}
+
+// equal items go after the existing ones.
+static t_rbpnode*
+insert_rec(t_rbpnode* node, void* item, t_pcompare cmp)
+{
+  t_rbpnode*  left;
+  t_rbpnode*  right;
+  void*       y;
+  uint8_t     color;
+  bool        dir;
+
+  if (node == NULL)
+    return make(RED, NULL, item, NULL);
+  y = node->item;
+  color = node->color;
+  dir = cmp(item, y) >= 0;
+  open_node(node, &left, &right);
+  if (dir)
+    right = insert_rec(right, item, cmp);
+  else
+    left = insert_rec(left, item, cmp);
+  return color == BLACK ? balance(left, y, right) : make(RED, left, y, right);
+}
+
+// @left lost one black, rebalanced against the black height of @right.
+static t_rbpnode*
+balance_left(t_rbpnode* left, void* x, t_rbpnode* right)
+{
+  t_rbpnode*  n1;
+  t_rbpnode*  n2;
+  t_rbpnode*  n3;
+  t_rbpnode*  inner;
+  void*       y;
+  void*       z;
+
+  if (is_red(left)) {
+    y = left->item;
+    open_node(left, &n1, &n2);
+    return make(RED, make(BLACK, n1, y, n2), x, right);
+  }
+  if (is_black(right)) {
+    return balance(left, x, make_red(right));
+  }
+  assert(is_red(right) && is_black(right->child[rb_left]));
+  y = right->child[rb_left]->item;
+  z = right->item;
+  open_node(right, &inner, &n3);
+  open_node(inner, &n1, &n2);
+  return make(RED, make(BLACK, left, x, n1), y, balance(n2, z, make_red(n3)));
+}
+
+// the mirror image of balance_left.
+static t_rbpnode*
+balance_right(t_rbpnode* left, void* x, t_rbpnode* right)
+{
+  t_rbpnode*  n1;
+  t_rbpnode*  n2;
+  t_rbpnode*  n3;
+  t_rbpnode*  inner;
+  void*       y;
+  void*       z;
+
+  if (is_red(right)) {
+    y = right->item;
+    open_node(right, &n1, &n2);
+    return make(RED, left, x, make(BLACK, n1, y, n2));
+  }
+  if (is_black(left)) {
+    return balance(make_red(left), x, right);
+  }
+  assert(is_red(left) && is_black(left->child[rb_right]));
+  y = left->item;
+  z = left->child[rb_right]->item;
+  open_node(left, &n1, &inner);
+  open_node(inner, &n2, &n3);
+  return make(RED, balance(make_red(n1), y, n2), z, make(BLACK, n3, x, right));
+}
+
+// joins two trees of equal black height, every item of @a before those of @b.
+static t_rbpnode*
+append(t_rbpnode* a, t_rbpnode* b)
+{
+  t_rbpnode*  a1;
+  t_rbpnode*  a2;
+  t_rbpnode*  b1;
+  t_rbpnode*  b2;
+  t_rbpnode*  mid;
+  t_rbpnode*  m1;
+  t_rbpnode*  m2;
+  void*       x;
+  void*       y;
+  void*       z;
+  uint8_t     color;
+
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (is_red(a) != is_red(b)) {
+    if (is_red(b)) {
+      y = b->item;
+      open_node(b, &b1, &b2);
+      return make(RED, append(a, b1), y, b2);
+    }
+    x = a->item;
+    open_node(a, &a1, &a2);
+    return make(RED, a1, x, append(a2, b));
+  }
+  // both red or both black
+  color = a->color;
+  x = a->item;
+  y = b->item;
+  open_node(a, &a1, &a2);
+  open_node(b, &b1, &b2);
+  mid = append(a2, b1);
+  if (is_red(mid)) {
+    z = mid->item;
+    open_node(mid, &m1, &m2);
+    return make(RED, make(color, a1, x, m1), z, make(color, m2, y, b2));
+  }
+  if (color == RED)
+    return make(RED, a1, x, make(RED, mid, y, b2));
+  return balance_left(a1, x, make(BLACK, mid, y, b2));
+}
+
+/*
+ * open_node for a node on the erase path, opened after the path below it.
+ * its child on side @dir, if @dir is not -1, was already taken apart.
+ * @ancestor_shared: an ancestor was shared, the node stays in place for the
+ *  versions holding it, and the reference open_node would consume was never
+ *  taken.
+ * @shared: the node or an ancestor was shared on the way down. the path below
+ *  was left in place then, so the node must not be recycled even if another
+ *  version let go of it since: releasing it frees the kept child with it.
+ */
+static inline void
+open_path(t_rbpnode* node, bool ancestor_shared, bool shared, int dir, t_rbpnode** left, t_rbpnode** right)
+{
+  *left = node->child[rb_left];
+  *right = node->child[rb_right];
+  if (!shared) {
+    put_spare(node);
+    return;
+  }
+  if (dir != rb_left)
+    retain(*left);
+  if (dir != rb_right)
+    retain(*right);
+  if (!ancestor_shared)
+    release(node);
+}
+
+/*
+ * the path is searched on the way down and rebuilt on the way up, once the
+ * key is known to be there. on a miss @node is returned untouched and
+ * *erased stays NULL, otherwise the reference to @node is consumed.
+ * @shared: an ancestor is shared with another version, so is this path.
+ */
+static t_rbpnode*
+erase_rec(t_rbpnode* node, const void* key, t_pcompare cmp, bool shared, void** erased)
+{
+  t_rbpnode*  left;
+  t_rbpnode*  right;
+  t_rbpnode*  sub = NULL;
+  void*       y;
+  int         cmp_ret;
+  bool        black_left;
+  bool        black_right;
+  bool        node_shared;
+
+  if (node == NULL)
+    return NULL;
+  // read once: a snapshot released during the descent must not change how
+  // the path is taken apart on the way up
+  node_shared = shared || is_shared(node);
+  y = node->item;
+  cmp_ret = cmp(key, y);
+  // read before the path below is taken apart and its nodes reused
+  black_left = is_black(node->child[rb_left]);
+  black_right = is_black(node->child[rb_right]);
+  if (cmp_ret != 0) {
+    sub = erase_rec(node->child[cmp_ret > 0], key, cmp, node_shared, erased);
+    if (*erased == NULL)
+      return node;
+  }
+
+  open_path(node, shared, node_shared, cmp_ret == 0 ? -1 : cmp_ret > 0, &left, &right);
+  if (cmp_ret < 0)
+    return black_left ? balance_left(sub, y, right) : make(RED, sub, y, right);
+  if (cmp_ret > 0)
+    return black_right ? balance_right(left, y, sub) : make(RED, left, y, sub);
+  *erased = y;
+  return append(left, right);
+}
+
+/*
+ * @tree: version to update, becomes the new version
+ * @item: item to add, compared as the key of @cmp, not NULL
+ * @cmp: user provided compare function
+ *
+ * copies the O(log n) nodes on the path that other versions share.
+ */
+void
+rb_p_insert(t_rbptree* tree, void* item, t_pcompare cmp)
+{
+  tree->root = make_black(insert_rec(tree->root, item, cmp));
+  ++tree->size;
+  trim_spare();
+}
+
+/*
+ * @tree: version to update, becomes the new version
+ * @key: key of the item to remove, any of equal ones
+ * @cmp: user provided compare function
+ *
+ * returns the removed item, NULL if none matched and @tree is left as is.
+ * the item itself is not freed: older versions may still hold it.
+ */
+void*
+rb_p_erase(t_rbptree* tree, const void* key, t_pcompare cmp)
+{
+  void*       erased = NULL;
+  t_rbpnode*  root = erase_rec(tree->root, key, cmp, false, &erased);
+
+  if (erased == NULL)
+    return NULL;
+  tree->root = make_black(root);
+  --tree->size;
+  trim_spare();
+  return erased;
+}
+
+void*
+rb_p_find(const t_rbptree* tree, const void* key, t_pcompare cmp)
+{
+  const t_rbpnode* cur = tree->root;
+
+  while (cur != NULL) {
+    int cmp_ret = cmp(key, cur->item);
+    if (cmp_ret == 0)
+      return cur->item;
+    cur = cur->child[cmp_ret > 0];
+  }
+  return NULL;
+}
+
+// an O(1) read-only view of @tree as it is now, released with rb_p_release.
+t_rbptree
+rb_p_snapshot(const t_rbptree* tree)
+{
+  retain(tree->root);
+  return *tree;
+}
+
+// frees the nodes no other version shares.
+void
+rb_p_release(t_rbptree* tree)
+{
+  release(tree->root);
+  tree->root = NULL;
+  tree->size = 0;
+  trim_spare();
+}
+
+static void*
+push_left(t_rbpiter* iter, const t_rbpnode* node)
+{
+  while (node != NULL) {
+    assert(iter->depth < RB_TD_MAX_HEIGHT);
+    iter->stack[iter->depth++] = node;
+    node = node->child[rb_left];
+  }
+  return iter->depth ? iter->stack[iter->depth - 1]->item : NULL;
+}
+
+/*
+ * @tree: version to scan, e.g. a snapshot while writes go on
+ * @iter: caller's stack of the ancestors still to visit
+ *
+ * returns the first item in order, NULL if the version is empty.
+ */
+void*
+rb_p_first(const t_rbptree* tree, t_rbpiter* iter)
+{
+  iter->depth = 0;
+  return push_left(iter, tree->root);
+}
+
+void*
+rb_p_next(t_rbpiter* iter)
+{
+  const t_rbpnode* node;
+
+  if (iter->depth == 0)
+    return NULL;
+  node = iter->stack[--iter->depth];
+  push_left(iter, node->child[rb_right]);
+  return iter->depth ? iter->stack[iter->depth - 1]->item : NULL;
+}
@@ -1,3 +1,4 @@
+#include "rbtree.h"
 #include "rbtree_tools.h"
 
 extern t_rbnode* rb_nil;
@@ -7,19 +8,150 @@ rb_find(const void* key, const t_rbtree* tree, t_compare cmp)
 {
   t_rbnode* cur = tree->root;
 
-  // binary search using user provided cmp function pointer and key
+  // binary search using user provided cmp function pointer and key.
+  // only the rarely taken equality test branches, the side is an index.
   while (cur != &rb_nil_node) {
     int cmp_ret = cmp(key, cur);
-    if (cmp_ret < 0)
-      cur = cur->left;
-    else if (cmp_ret > 0)
-      cur = cur->right;
-    else
+    if (cmp_ret == 0)
       return cur;
+    cur = cur->child[cmp_ret > 0];
+  }
+  return NULL;
+}
+
+/*
+ * equal keys are kept in insertion order, since inserts put them on the right.
+ * rb_find returns any of them, the bounds below locate the whole run.
+ */
+
+// first node not less than key, NULL if none.
+t_rbnode*
+rb_lower_bound(const void* key, const t_rbtree* tree, t_compare cmp)
+{
+  t_rbnode* cur = tree->root;
+  t_rbnode* result = NULL;
+
+  while (cur != &rb_nil_node) {
+    bool dir = cmp(key, cur) > 0;
+
+    result = dir ? result : cur;
+    cur = cur->child[dir];
+  }
+  return result;
+}
+
+// first node greater than key, NULL if none.
+t_rbnode*
+rb_upper_bound(const void* key, const t_rbtree* tree, t_compare cmp)
+{
+  t_rbnode* cur = tree->root;
+  t_rbnode* result = NULL;
+
+  while (cur != &rb_nil_node) {
+    bool dir = cmp(key, cur) >= 0;
+
+    result = dir ? result : cur;
+    cur = cur->child[dir];
+  }
+  return result;
+}
+
+// nodes equal to key are [*first, *end), walked with rb_next.
+void
+rb_equal_range(const void* key, const t_rbtree* tree, t_compare cmp, t_rbnode** first, t_rbnode** end)
+{
+  *first = rb_lower_bound(key, tree, cmp);
+  *end = rb_upper_bound(key, tree, cmp);
+}
+
+size_t
+rb_count_equal(const void* key, const t_rbtree* tree, t_compare cmp)
+{
+  size_t    count = 0;
+  t_rbnode* node = rb_lower_bound(key, tree, cmp);
+
+  while (node != NULL && cmp(key, node) == 0) {
+    ++count;
+    node = rb_next(node);
   }
+  return count;
+}
+
+/*
+ * @key: key to look up
+ * @tree: tree to search
+ * @cmp: user provided compare function
+ * @parent, @link: where a node with @key would be linked, for rb_insert_at
+ *
+ * returns the node equal to @key, or NULL after filling @parent and @link.
+ * lets callers build the new node only when the key is missing.
+ */
+t_rbnode*
+rb_find_insert_pos(const void* key, t_rbtree* tree, t_compare cmp, t_rbnode** parent, t_rbnode*** link)
+{
+  t_rbnode** cur = &tree->root;
+
+  *parent = rb_nil;
+  while (*cur != &rb_nil_node) {
+    int cmp_ret = cmp(key, *cur);
+    if (cmp_ret == 0)
+      return *cur;
+    *parent = *cur;
+    cur = &(*cur)->child[cmp_ret > 0];
+  }
+  *link = cur;
   return NULL;
 }
 
+/*
+ * @keys: keys to look up
+ * @n: number of keys
+ * @tree: tree to search
+ * @cmp: user provided compare function
+ * @out: out[i] is set to a node equal to keys[i], NULL if none
+ *
+ * runs RB_BATCH_LANES descents in turn, one level each, prefetching the
+ * next node of a descent before moving to the others, so the cache misses of
+ * different keys overlap instead of stalling one by one.
+ * a finished lane starts the next key right away.
+ */
+void
+rb_find_batch(const void* const* keys, size_t n, const t_rbtree* tree, t_compare cmp, t_rbnode** out)
+{
+  t_rbnode* cur[RB_BATCH_LANES];
+  size_t    idx[RB_BATCH_LANES];
+  size_t    next = 0;
+  int       active = 0;
+
+  while (active < RB_BATCH_LANES && next < n) {
+    cur[active] = tree->root;
+    idx[active++] = next++;
+  }
+  while (active > 0) {
+    for (int lane = 0; lane < active; ) {
+      t_rbnode* node = cur[lane];
+      int       cmp_ret;
+
+      if (node != &rb_nil_node && (cmp_ret = cmp(keys[idx[lane]], node)) != 0) {
+        node = node->child[cmp_ret > 0];
+        __builtin_prefetch(node);
+        cur[lane++] = node;
+        continue;
+      }
+      out[idx[lane]] = node != &rb_nil_node ? node : NULL;
+      if (next < n) {
+        cur[lane] = tree->root;
+        idx[lane++] = next++;
+      } else {
+        // the last lane takes this slot and is stepped next
+        --active;
+        cur[lane] = cur[active];
+        idx[lane] = idx[active];
+      }
+    }
+  }
+}
+
 t_rbnode*
 rb_first(t_rbtree* tree)
 {
@@ -54,19 +186,96 @@ rb_next(t_rbnode* node)
   }
 }
 
+t_rbnode*
+rb_last(t_rbtree* tree)
+{
+  t_rbnode* node = tree->root;
+
+  if (node == rb_nil) return NULL;
+
+  while (node->right != rb_nil) {
+    node = node->right;
+  }
+  return node;
+}
+
+t_rbnode*
+rb_prev(t_rbnode* node)
+{
+  if (node->left == &rb_nil_node) {
+    t_rbnode* parent = get_parent(node);
+    while (parent != &rb_nil_node) {
+      if (parent->right == node)
+        return parent;
+      node = parent;
+      parent = get_parent(parent);
+    }
+    return NULL;
+  } else {
+    node = node->left;
+    while (node->right != &rb_nil_node) {
+      node = node->right;
+    }
+    return node;
+  }
+}
+
+// first node in postorder under @node: keep going down, left if possible.
+static t_rbnode*
+left_deepest(t_rbnode* node)
+{
+  while (true) {
+    if (node->left != &rb_nil_node)
+      node = node->left;
+    else if (node->right != &rb_nil_node)
+      node = node->right;
+    else
+      return node;
+  }
+}
+
 /*
-t_rbnode*  rb_prev(t_rbnode* node)
+ * postorder iteration visits children before their parent, so each node may
+ * be freed once the next one is known. parent pointers replace the stack.
+ */
+t_rbnode*
+rb_first_postorder(t_rbtree* tree)
 {
+  if (tree->root == &rb_nil_node) return NULL;
+
+  return left_deepest(tree->root);
 }
-*/
 
-// need stack data structure to properly implement this without using recursion.
+t_rbnode*
+rb_next_postorder(t_rbnode* node)
+{
+  t_rbnode* parent = get_parent(node);
+
+  if (parent == &rb_nil_node)
+    return NULL;
+  // coming up from the left, the right subtree is next.
+  if (parent->left == node && parent->right != &rb_nil_node)
+    return left_deepest(parent->right);
+  return parent;
+}
+
+/*
+ * calls @op on every node of the subtree of @node, children first.
+ * the next node is found before @op runs, so @op may free or relink the node.
+ */
 void
 rb_postorder_foreach(t_rbnode* node, void (*op)(t_rbnode*))
 {
+  t_rbnode* root = node;
+  t_rbnode* next;
+
   if (node == rb_nil) return;
 
-  rb_postorder_foreach(node->left, op);
-  rb_postorder_foreach(node->right, op);
-  op(node);
+  node = left_deepest(root);
+  while (true) {
+    next = node == root ? NULL : rb_next_postorder(node);
+    op(node);
+    if (next == NULL) return;
+    node = next;
+  }
 }
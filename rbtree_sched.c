@@ -0,0 +1,273 @@
+/*
+ * rbtree_sched.c
+ *
+ * Completely Fair Scheduler over cached trees: each CPU has a run queue of
+ * entities ordered by vruntime, their runtime scaled by the inverse of their
+ * weight, and runs the leftmost one. The running entity is kept out of its
+ * tree, as in Linux, so picking it is a pop and preempting it an insert.
+ * Load balancing steals from the rightmost end of the busiest queue, the
+ * entities that would wait longest there.
+ *
+ * reference
+ * Linux kernel/sched/fair.c
+ */
+#include <sched.h>
+#include <stdlib.h>
+
+#include "rbtree.h"
+#include "rbtree_tools.h"
+
+// runtime the running entity may lead the leftmost one by, in ns of vruntime.
+#define RB_SCHED_GRANULARITY 1000000
+
+// spinlocks as rq->lock, yielding so that threads sharing a core progress.
+static inline void
+rq_lock(t_rbrunqueue* rq)
+{
+  while (__atomic_exchange_n(&rq->lock, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&rq->lock, __ATOMIC_RELAXED)) {
+      sched_yield();
+    }
+  }
+}
+
+static inline void
+rq_unlock(t_rbrunqueue* rq)
+{
+  __atomic_store_n(&rq->lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline t_rbentity*
+entity_of(t_rbnode* node)
+{
+  return node != NULL ? container_of(node, t_rbentity, node) : NULL;
+}
+
+// wrap-safe, vruntimes are compared by their difference.
+static inline bool
+vruntime_before(uint64_t a, uint64_t b)
+{
+  return (int64_t)(a - b) < 0;
+}
+
+static bool
+entity_less(t_rbnode* n1, const t_rbnode* n2)
+{
+  return vruntime_before(entity_of(n1)->vruntime,
+                         container_of(n2, t_rbentity, node)->vruntime);
+}
+
+// min_vruntime only moves forward, following the smallest of curr and leftmost.
+static void
+update_min_vruntime(t_rbrunqueue* rq)
+{
+  t_rbentity* leftmost = entity_of(rb_leftmost(&rq->tasks));
+  uint64_t    vruntime = rq->min_vruntime;
+
+  if (rq->curr != NULL)
+    vruntime = rq->curr->vruntime;
+  if (leftmost != NULL && (rq->curr == NULL || vruntime_before(leftmost->vruntime, vruntime)))
+    vruntime = leftmost->vruntime;
+  if (vruntime_before(rq->min_vruntime, vruntime))
+    rq->min_vruntime = vruntime;
+}
+
+static inline void
+queue_entity(t_rbrunqueue* rq, t_rbentity* se)
+{
+  rb_insert_cached(&rq->tasks, &se->node, entity_less);
+}
+
+// the balancer reads loads without the lock.
+static inline void
+add_load(t_rbrunqueue* rq, int64_t weight)
+{
+  __atomic_store_n(&rq->load, rq->load + weight, __ATOMIC_RELAXED);
+}
+
+bool
+rb_sched_init(t_rbsched* sched, int cpus)
+{
+  void* rq;
+
+  if (cpus <= 0 || posix_memalign(&rq, 64, cpus * sizeof(t_rbrunqueue)) != 0)
+    return false;
+  sched->rq = (t_rbrunqueue*)rq;
+  sched->cpus = cpus;
+  for (int cpu = 0; cpu < cpus; ++cpu) {
+    sched->rq[cpu].tasks = rb_create_tree_cached();
+    sched->rq[cpu].curr = NULL;
+    sched->rq[cpu].min_vruntime = 0;
+    sched->rq[cpu].load = 0;
+    sched->rq[cpu].nr_running = 0;
+    sched->rq[cpu].lock = 0;
+  }
+  return true;
+}
+
+// entities still queued are left as they are, owned by the caller.
+void
+rb_sched_destroy(t_rbsched* sched)
+{
+  free(sched->rq);
+  sched->rq = NULL;
+  sched->cpus = 0;
+}
+
+/*
+ * @sched: scheduler
+ * @cpu: run queue to join
+ * @se: entity not queued anywhere, e.g. new or waking up
+ *
+ * an entity is placed no earlier than min_vruntime, so one that slept
+ * does not get the CPU for as long as it was away.
+ */
+void
+rb_sched_enqueue(t_rbsched* sched, int cpu, t_rbentity* se)
+{
+  t_rbrunqueue* rq = &sched->rq[cpu];
+
+  // ticks divide by the weight
+  assert(se->weight != 0);
+  rq_lock(rq);
+  if (vruntime_before(se->vruntime, rq->min_vruntime))
+    se->vruntime = rq->min_vruntime;
+  se->cpu = cpu;
+  queue_entity(rq, se);
+  add_load(rq, se->weight);
+  rq->nr_running++;
+  update_min_vruntime(rq);
+  rq_unlock(rq);
+}
+
+// removes @se, running or queued, from its run queue, e.g. to sleep.
+void
+rb_sched_dequeue(t_rbsched* sched, t_rbentity* se)
+{
+  t_rbrunqueue* rq;
+
+  // the balancer may move @se until its queue is locked
+  while (true) {
+    int cpu = __atomic_load_n(&se->cpu, __ATOMIC_ACQUIRE);
+
+    if (cpu < 0)
+      return;
+    rq = &sched->rq[cpu];
+    rq_lock(rq);
+    if (se->cpu == cpu)
+      break;
+    rq_unlock(rq);
+  }
+  if (rq->curr == se)
+    rq->curr = NULL;
+  else
+    rb_erase_cached(&rq->tasks, &se->node);
+  add_load(rq, -(int64_t)se->weight);
+  rq->nr_running--;
+  __atomic_store_n(&se->cpu, -1, __ATOMIC_RELEASE);
+  update_min_vruntime(rq);
+  rq_unlock(rq);
+}
+
+// puts the running entity back and runs the leftmost one, NULL if idle.
+t_rbentity*
+rb_sched_pick_next(t_rbsched* sched, int cpu)
+{
+  t_rbrunqueue* rq = &sched->rq[cpu];
+  t_rbentity*   next;
+
+  rq_lock(rq);
+  if (rq->curr != NULL)
+    queue_entity(rq, rq->curr);
+  rq->curr = entity_of(rb_pop_first(&rq->tasks));
+  update_min_vruntime(rq);
+  next = rq->curr;
+  rq_unlock(rq);
+  return next;
+}
+
+/*
+ * @sched: scheduler
+ * @cpu: run queue of the calling CPU
+ * @delta_ns: time the running entity ran since the last tick
+ *
+ * charges the running entity and preempts it once it leads the leftmost one
+ * by more than RB_SCHED_GRANULARITY. starts running the leftmost one if the
+ * CPU was idle. returns the entity to run until the next tick, NULL if idle.
+ */
+t_rbentity*
+rb_sched_tick(t_rbsched* sched, int cpu, uint64_t delta_ns)
+{
+  t_rbrunqueue* rq = &sched->rq[cpu];
+  t_rbentity*   curr;
+  t_rbentity*   leftmost;
+
+  rq_lock(rq);
+  curr = rq->curr;
+  if (curr != NULL)
+    curr->vruntime += delta_ns * RB_SCHED_NICE_0_LOAD / curr->weight;
+  leftmost = entity_of(rb_leftmost(&rq->tasks));
+  if (leftmost != NULL
+      && (curr == NULL || vruntime_before(leftmost->vruntime + RB_SCHED_GRANULARITY, curr->vruntime))) {
+    if (curr != NULL)
+      queue_entity(rq, curr);
+    rq->curr = entity_of(rb_pop_first(&rq->tasks));
+  }
+  update_min_vruntime(rq);
+  curr = rq->curr;
+  rq_unlock(rq);
+  return curr;
+}
+
+/*
+ * @sched: scheduler
+ *
+ * moves entities from the rightmost end of the most loaded queue to the
+ * least loaded one while each move narrows the gap between them. the
+ * vruntime of a moved entity keeps its lead over min_vruntime.
+ * returns the number of entities moved.
+ */
+size_t
+rb_sched_balance(t_rbsched* sched)
+{
+  t_rbrunqueue* busiest = NULL;
+  t_rbrunqueue* idlest = NULL;
+  size_t        moved = 0;
+
+  // loads are read without locks, the choice is only a heuristic
+  for (int cpu = 0; cpu < sched->cpus; ++cpu) {
+    t_rbrunqueue* rq = &sched->rq[cpu];
+    uint64_t      load = __atomic_load_n(&rq->load, __ATOMIC_RELAXED);
+
+    if (busiest == NULL || load > __atomic_load_n(&busiest->load, __ATOMIC_RELAXED))
+      busiest = rq;
+    if (idlest == NULL || load < __atomic_load_n(&idlest->load, __ATOMIC_RELAXED))
+      idlest = rq;
+  }
+  if (busiest == idlest)
+    return 0;
+
+  // locks are taken in CPU order
+  rq_lock(busiest < idlest ? busiest : idlest);
+  rq_lock(busiest < idlest ? idlest : busiest);
+  while (true) {
+    t_rbentity* se = entity_of(rb_rightmost(&busiest->tasks));
+
+    if (se == NULL || busiest->load < idlest->load + 2 * (uint64_t)se->weight)
+      break;
+    rb_pop_last(&busiest->tasks);
+    add_load(busiest, -(int64_t)se->weight);
+    busiest->nr_running--;
+    se->vruntime = se->vruntime - busiest->min_vruntime + idlest->min_vruntime;
+    __atomic_store_n(&se->cpu, (int)(idlest - sched->rq), __ATOMIC_RELEASE);
+    queue_entity(idlest, se);
+    add_load(idlest, se->weight);
+    idlest->nr_running++;
+    ++moved;
+  }
+  update_min_vruntime(busiest);
+  update_min_vruntime(idlest);
+  rq_unlock(idlest);
+  rq_unlock(busiest);
+  return moved;
+}
@@ -0,0 +1,222 @@
+/*
+ * rbtree_seq.c
+ *
+ * Tree with one writer and lockless readers, guarded by a sequence count as
+ * Linux latch trees and seqcount_t are.
+ * The writer makes the count odd, publishes every link with an atomic store,
+ * then makes it even again. A reader descends with atomic loads and starts
+ * over if the count changed meanwhile. Rotations may briefly leave a reader
+ * on a wrong or cyclic path, so a descent also gives up after
+ * RB_SEQ_MAX_STEPS and starts over.
+ * Erased nodes must not be freed while readers may still hold them.
+ *
+ * reference
+ * https://elixir.bootlin.com/linux/latest/source/include/linux/rbtree_latch.h
+ * Boehm. Can seqlocks get along with programming language memory models? 2012.
+ */
+#include <sched.h>
+
+#include "rbtree.h"
+#include "rbtree_tools.h"
+
+// longer than any path, a tree of n nodes is at most 2 * log2(n + 1) high.
+#define RB_SEQ_MAX_STEPS 128
+
+static inline void
+seq_set_parent(t_rbnode* node, t_rbnode* parent)
+{
+  uintptr_t pc = ((uintptr_t)parent & ~(uintptr_t)1) | get_color(node);
+
+  assert(node != &rb_nil_node);
+  __atomic_store_n(&node->pc.parent, (t_rbnode*)pc, __ATOMIC_RELAXED);
+}
+
+static inline void
+seq_set_color(t_rbnode* node, uint8_t color)
+{
+  uintptr_t pc = (uintptr_t)get_parent(node) | color;
+
+  assert(!(color == RED && node == &rb_nil_node));
+  __atomic_store_n(&node->pc.parent, (t_rbnode*)pc, __ATOMIC_RELAXED);
+}
+
+#define RB_NODE                   t_rbnode
+#define RB_TREE                   t_rbtree
+#define RB_FN(name)               seq_##name
+#define RB_NIL                    (&rb_nil_node)
+#define RB_SET_ROOT(n)            __atomic_store_n(&tree->root, n, __ATOMIC_RELEASE)
+#define RB_CHILD(n, dir)          ((n)->child[dir])
+#define RB_SET_CHILD(n, dir, c)   __atomic_store_n(&(n)->child[dir], c, __ATOMIC_RELEASE)
+#define RB_PARENT(n)              get_parent(n)
+#define RB_SET_PARENT(n, p)       seq_set_parent(n, p)
+#define RB_COLOR(n)               get_color(n)
+#define RB_SET_COLOR(n, c)        seq_set_color(n, c)
+#define RB_AUG_PARAM
+#define RB_AUG_ARG
+#define RB_AUG_ROTATE(old, new_node)
+#define RB_AUG_COPY(old, new_node)
+#define RB_AUG_PROPAGATE(parent, successor)
+#include "rbtree_balance.h"
+
+// the count goes odd before the first store of a change is visible.
+static inline void
+write_begin(t_rbtree_seq* tree)
+{
+  __atomic_store_n(&tree->seq, tree->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+write_end(t_rbtree_seq* tree)
+{
+  __atomic_store_n(&tree->seq, tree->seq + 1, __ATOMIC_RELEASE);
+}
+
+// waits out a writer in progress, it will not finish while we spin on one core.
+static inline unsigned
+read_begin(const t_rbtree_seq* tree)
+{
+  unsigned seq;
+
+  while ((seq = __atomic_load_n(&tree->seq, __ATOMIC_ACQUIRE)) & 1) {
+    sched_yield();
+  }
+  return seq;
+}
+
+static inline bool
+read_retry(const t_rbtree_seq* tree, unsigned seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&tree->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline t_rbnode*
+load_child(const t_rbnode* node, uint8_t dir)
+{
+  return __atomic_load_n(&node->child[dir], __ATOMIC_ACQUIRE);
+}
+
+static inline t_rbnode*
+load_parent(const t_rbnode* node)
+{
+  uintptr_t pc = (uintptr_t)__atomic_load_n(&node->pc.parent, __ATOMIC_ACQUIRE);
+
+  return (t_rbnode*)(pc & ~(uintptr_t)1);
+}
+
+/*
+ * @tree: tree to insert in, only ever changed by this thread
+ * @node: new node
+ * @less: user provided boolean function which indicate less or not
+ *
+ * the node is filled in before the release store that links it, so a reader
+ * reaching it sees its children and key.
+ */
+void
+rb_seq_insert(t_rbtree_seq* tree, t_rbnode* node, t_less less)
+{
+  t_rbnode**  insert_at = &tree->rbtree.root;
+  t_rbnode*   parent = rb_nil;
+
+  while (*insert_at != rb_nil) {
+    parent = *insert_at;
+    insert_at = &parent->child[!less(node, parent)];
+  }
+  node->pc.parent = parent;
+  node->pc.color = RED;
+  node->left = rb_nil;
+  node->right = rb_nil;
+
+  write_begin(tree);
+  __atomic_store_n(insert_at, node, __ATOMIC_RELEASE);
+  seq_insert_balance(&tree->rbtree, node);
+  write_end(tree);
+}
+
+void
+rb_seq_erase(t_rbtree_seq* tree, t_rbnode* node)
+{
+  write_begin(tree);
+  seq_erase_node(&tree->rbtree, node);
+  write_end(tree);
+}
+
+/*
+ * @key: key to look up
+ * @tree: tree to search, may be changed by its writer meanwhile
+ * @cmp: user provided compare function
+ *
+ * lock free, retried until a descent overlaps no change.
+ */
+t_rbnode*
+rb_seq_find(const void* key, const t_rbtree_seq* tree, t_compare cmp)
+{
+  while (true) {
+    unsigned  seq = read_begin(tree);
+    t_rbnode* cur = __atomic_load_n(&tree->rbtree.root, __ATOMIC_ACQUIRE);
+    int       steps = 0;
+
+    while (cur != &rb_nil_node && steps++ < RB_SEQ_MAX_STEPS) {
+      int cmp_ret = cmp(key, cur);
+      if (cmp_ret == 0)
+        break;
+      cur = load_child(cur, cmp_ret > 0);
+    }
+    if (!read_retry(tree, seq) && steps <= RB_SEQ_MAX_STEPS)
+      return cur != &rb_nil_node ? cur : NULL;
+  }
+}
+
+t_rbnode*
+rb_seq_first(const t_rbtree_seq* tree)
+{
+  while (true) {
+    unsigned  seq = read_begin(tree);
+    t_rbnode* node = __atomic_load_n(&tree->rbtree.root, __ATOMIC_ACQUIRE);
+    t_rbnode* left;
+    int       steps = 0;
+
+    if (node != &rb_nil_node) {
+      while ((left = load_child(node, rb_left)) != &rb_nil_node && steps++ < RB_SEQ_MAX_STEPS) {
+        node = left;
+      }
+    }
+    if (!read_retry(tree, seq) && steps <= RB_SEQ_MAX_STEPS)
+      return node != &rb_nil_node ? node : NULL;
+  }
+}
+
+/*
+ * @tree: tree of @node
+ * @node: node still in the tree
+ *
+ * in-order next node as of some moment after the call started.
+ */
+t_rbnode*
+rb_seq_next(const t_rbtree_seq* tree, t_rbnode* node)
+{
+  while (true) {
+    unsigned  seq = read_begin(tree);
+    t_rbnode* cur = node;
+    t_rbnode* next = load_child(cur, rb_right);
+    int       steps = 0;
+
+    if (next != &rb_nil_node) {
+      t_rbnode* left;
+
+      while ((left = load_child(next, rb_left)) != &rb_nil_node && steps++ < RB_SEQ_MAX_STEPS) {
+        next = left;
+      }
+    } else {
+      // first ancestor reached from its left
+      next = load_parent(cur);
+      while (next != &rb_nil_node && load_child(next, rb_left) != cur && steps++ < RB_SEQ_MAX_STEPS) {
+        cur = next;
+        next = load_parent(cur);
+      }
+    }
+    if (!read_retry(tree, seq) && steps <= RB_SEQ_MAX_STEPS)
+      return next != &rb_nil_node ? next : NULL;
+  }
+}
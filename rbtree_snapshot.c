@@ -0,0 +1,135 @@
+/*
+ * rbtree_snapshot.c
+ *
+ * Read-only copy of a tree's keys and nodes in Eytzinger (BFS) order:
+ * position 1 is the root and k has children 2k and 2k + 1, in one array.
+ * The top levels share a few cache lines, and the next levels are prefetched
+ * during a branchless descent, so a lookup costs far fewer misses than
+ * following pointers.
+ *
+ * reference
+ * Khuong, Morin. Array layouts for comparison-based searching. 2017.
+ */
+#include <stdlib.h>
+
+#include "rbtree.h"
+
+// in-order successor of position k in a complete tree of n positions.
+static inline size_t
+eytzinger_next(size_t k, size_t n)
+{
+  if (2 * k + 1 <= n) {
+    k = 2 * k + 1;
+    while (2 * k <= n) {
+      k = 2 * k;
+    }
+    return k;
+  }
+  // climb while k is a right child, then once more
+  while (k & 1) {
+    k >>= 1;
+  }
+  return k >> 1;
+}
+
+static inline size_t
+eytzinger_first(size_t n)
+{
+  size_t k = 1;
+
+  if (n == 0)
+    return 0;
+  while (2 * k <= n) {
+    k = 2 * k;
+  }
+  return k;
+}
+
+/*
+ * @tree: tree to copy, left untouched
+ * @key: int64_t key of a node, in the order of the tree
+ * @snap: snapshot to fill, from rb_create_snapshot or an earlier rb_freeze
+ *
+ * the positions are visited in order while walking the tree in order, so the
+ * copy is one pass with no sorting. the buffers of @snap are reused when large
+ * enough, so refreshing a snapshot as the live tree changes does not allocate.
+ * the snapshot holds node pointers: refresh it before erased nodes are freed.
+ * returns false if out of memory, @snap is then left as it was.
+ */
+bool
+rb_freeze(t_rbtree* tree, int64_t (*key)(const t_rbnode*), t_rbsnapshot* snap)
+{
+  size_t    n = 0;
+  size_t    k;
+  t_rbnode* node;
+
+  for (node = rb_first(tree); node != NULL; node = rb_next(node)) {
+    ++n;
+  }
+  if (n > snap->capacity) {
+    void*       keys;
+    t_rbnode**  nodes;
+
+    // position 0 is unused, keys are aligned so a node of 8 keys fills one line
+    if (posix_memalign(&keys, 64, (n + 1) * sizeof(int64_t)) != 0)
+      return false;
+    nodes = (t_rbnode**)malloc((n + 1) * sizeof(t_rbnode*));
+    if (nodes == NULL) {
+      free(keys);
+      return false;
+    }
+    rb_snapshot_destroy(snap);
+    snap->keys = (int64_t*)keys;
+    snap->nodes = nodes;
+    snap->capacity = n;
+  }
+  snap->size = n;
+  k = eytzinger_first(n);
+  for (node = rb_first(tree); node != NULL; node = rb_next(node)) {
+    snap->keys[k] = key(node);
+    snap->nodes[k] = node;
+    k = eytzinger_next(k, n);
+  }
+  return true;
+}
+
+void
+rb_snapshot_destroy(t_rbsnapshot* snap)
+{
+  free(snap->keys);
+  free(snap->nodes);
+  snap->keys = NULL;
+  snap->nodes = NULL;
+  snap->size = 0;
+  snap->capacity = 0;
+}
+
+/*
+ * position of the first key not less than @key, 0 if none.
+ * the loop has no data dependent branch: the comparison result picks the
+ * child, and the descent always runs to the bottom. the positions where it
+ * went right are the trailing ones of k, shifting them out with the last left
+ * turn gives the answer.
+ */
+size_t
+rb_snapshot_lower_bound(const t_rbsnapshot* snap, int64_t key)
+{
+  const int64_t*  keys = snap->keys;
+  size_t          n = snap->size;
+  size_t          k = 1;
+
+  while (k <= n) {
+    // the 8 descendants of k three levels down share one cache line
+    __builtin_prefetch(keys + 8 * k);
+    k = 2 * k + (keys[k] < key);
+  }
+  k >>= __builtin_ffsll(~k);
+  return k;
+}
+
+// in-order next position for range scans, 0 at the end.
+size_t
+rb_snapshot_next(const t_rbsnapshot* snap, size_t pos)
+{
+  return eytzinger_next(pos, snap->size);
+}
@@ -1,15 +1,32 @@
 #include <iostream>
+#include <algorithm>
 #include <map>
+#include <queue>
+#include <deque>
+#include <set>
+#include <string>
 #include <unordered_set>
 #include <vector>
 #include <chrono>
+#include <thread>
+#include <random>
+#include <atomic>
+#include <mutex>
 
 #include <ctime>
 #include <cstdlib>
 #include <string.h>
 #include <assert.h>
+#include <linux/perf_event.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "rbtree.h"
+#include "rbtree.hpp"
+#include "rbtree_generate.h"
 
 static bool       compare_flag = true;
 
@@ -76,42 +93,2676 @@ bool  check_equal(t_rbtree* tree, std::map<int, int>& map)
   return node == NULL;
 }
 
-void check_erase(std::vector<int>& idx_arr, rbtree* rbtree, std::map<int, int>& map)
+// cached ends and, if @reverse, reverse iteration must agree with the map.
+bool  check_cached(t_rbtree_cached* tree, std::map<int, int>& map, bool reverse)
+{
+  if (map.size() == 0) {
+    return rb_leftmost(tree) == NULL && rb_rightmost(tree) == NULL;
+  }
+  if (rb_leftmost(tree) != rb_first(&tree->rbtree) || rb_rightmost(tree) != rb_last(&tree->rbtree)) {
+    std::cout << "cached leftmost or rightmost is stale\n";
+    return false;
+  }
+  if (reverse == false) {
+    return true;
+  }
+
+  t_rbnode* node = rb_rightmost(tree);
+  for (std::map<int, int>::reverse_iterator itr = map.rbegin(); itr != map.rend(); ++itr) {
+    if (node == NULL || container_of(node, t_container, node)->key != itr->first) {
+      std::cout << "reverse iteration failed at key " << itr->first << '\n';
+      return false;
+    }
+    node = rb_prev(node);
+  }
+  return node == NULL;
+}
+
+void check_erase(std::vector<int>& idx_arr, t_rbtree_cached* rbtree, std::map<int, int>& map)
 {
   for (size_t i = 0; i < idx_arr.size(); ++i) {
     int key = idx_arr[i];
 
     //std::cout << std::endl;
     //std::cout << "key = " << key << ", c->node = " << &c->node << ", c->key = " << c->key << ", c->val = " << c->val << '\n';
-    t_rbnode* node = rb_find(reinterpret_cast<void*>(key), rbtree, rb_compare);
+    t_rbnode* node = rb_find_cached(reinterpret_cast<void*>(key), rbtree, rb_compare);
     t_container* c = container_of(node, t_container, node);
-    rb_erase(rbtree, node);
+    rb_erase_cached(rbtree, node);
     free(c);
     if (compare_flag) {
       map.erase(key);
+      if (check_cached(rbtree, map, false) == false) {
+        std::cout << i << "th erase, key = " << key << ": check_cached fail\n";
+        return;
+      }
+    }
+
+    /*
+    if (check_equal(rbtree, map) == false) {
+      std::cout << i << "th erase, key = " << key << ": check_erase fail\n";
+      return;
+    }
+    */
+  }
+  //std::cout << "erase success\n";
+}
+
+// duplicate keys must come out in insertion order, like std::multimap.
+bool  check_multimap(bool quick)
+{
+  int size = quick ? 1 << 10 : 1 << 16;
+  int range = size / 16;
+  t_rbtree_cached tree = rb_create_tree_cached();
+  t_rbnode* hint = NULL;
+  std::multimap<int, int> map;
+  std::vector<t_container> containers(size);
+
+  for (int i = 0; i < size; ++i) {
+    containers[i].key = std::rand() % range;
+    containers[i].val = i;
+    // mix the descent, the cached ends and hints
+    if (i % 3 == 0) {
+      rb_insert_hint_cached(&tree, &containers[i].node, hint, rb_less);
+    } else {
+      rb_insert_cached(&tree, &containers[i].node, rb_less);
+    }
+    hint = &containers[i].node;
+    map.insert(std::make_pair(containers[i].key, i));
+  }
+  // erasing from the middle of a run must keep the others in order.
+  for (int i = 0; i < size; i += 5) {
+    rb_erase_cached(&tree, &containers[i].node);
+    auto range = map.equal_range(containers[i].key);
+    for (auto itr = range.first; itr != range.second; ++itr) {
+      if (itr->second == i) {
+        map.erase(itr);
+        break;
+      }
+    }
+  }
+
+  if (tree.leftmost_node != rb_first(&tree.rbtree) || tree.rightmost_node != rb_last(&tree.rbtree)) {
+    std::cout << "multimap cached ends are stale\n";
+    return false;
+  }
+  t_rbnode* node = rb_first(&tree.rbtree);
+  for (auto itr = map.begin(); itr != map.end(); ++itr, node = rb_next(node)) {
+    t_container* c = container_of(node, t_container, node);
+    if (node == NULL || c->key != itr->first || c->val != itr->second) {
+      std::cout << "multimap order differs at key " << itr->first << '\n';
+      return false;
+    }
+  }
+  for (int key = -1; key <= range; ++key) {
+    void* k = reinterpret_cast<void*>(key);
+    t_rbnode* first;
+    t_rbnode* end;
+    auto expected = map.equal_range(key);
+
+    rb_equal_range(k, &tree.rbtree, rb_compare, &first, &end);
+    if (rb_count_equal(k, &tree.rbtree, rb_compare) != map.count(key)
+        || (first == NULL) != (expected.first == map.end())
+        || (end == NULL) != (expected.second == map.end())
+        || (first != NULL && container_of(first, t_container, node)->val != expected.first->second)
+        || (end != NULL && container_of(end, t_container, node)->val != expected.second->second)
+        || rb_lower_bound(k, &tree.rbtree, rb_compare) != first
+        || rb_upper_bound(k, &tree.rbtree, rb_compare) != end) {
+      std::cout << "multimap range differs at key " << key << '\n';
+      return false;
+    }
+  }
+  return true;
+}
+
+void deallocate(t_rbtree* tree)
+{
+  rb_destroy(tree, deallocate);
+}
+
+struct container_less
+{
+  bool operator()(const t_container& a, const t_container& b) const { return a.key < b.key; }
+  bool operator()(int a, const t_container& b) const { return a < b.key; }
+  bool operator()(const t_container& a, int b) const { return a.key < b; }
+};
+
+typedef rb::intrusive_tree<t_container, &t_container::node, container_less> t_intrusive_tree;
+
+template <class Func>
+static double measure(Func func)
+{
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double> duration(end - start);
+  return duration.count();
+}
+
+static void print_ratio(const char* name, double rb_time, double other_time, const char* other)
+{
+  std::cout << name << ": rbtree = " << rb_time << ", " << other << " = " << other_time;
+  std::cout << ", ratio = " << rb_time / other_time << '\n';
+}
+
+// user space count of a hardware event in this thread while running func, -1 if the counter is unavailable.
+template <class Func>
+static long long count_event(unsigned long long config, Func func)
+{
+  struct perf_event_attr attr;
+  long long count = -1;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0) {
+    func();
+    return -1;
+  }
+  ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  func();
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+    count = -1;
+  }
+  close(fd);
+  return count;
+}
+
+template <class Func>
+static long long count_branch_misses(Func func)
+{
+  return count_event(PERF_COUNT_HW_BRANCH_MISSES, func);
+}
+
+template <class Func>
+static long long count_cache_misses(Func func)
+{
+  return count_event(PERF_COUNT_HW_CACHE_MISSES, func);
+}
+
+static void print_misses(const char* name, long long misses, int ops, const char* event = "branch misses")
+{
+  std::cout << name << ": " << event << " per op = ";
+  if (misses < 0) {
+    std::cout << "unavailable\n";
+  } else {
+    std::cout << static_cast<double>(misses) / ops << '\n';
+  }
+}
+
+// descents on random keys pick the side by indexing child[], so they should miss about once per node less than std::map.
+void bench_branch_misses(bool quick)
+{
+  int size = quick ? 1 << 12 : 1 << 20;
+  std::minstd_rand rng(size);
+  std::vector<t_container> containers(size);
+  std::vector<int> keys(size);
+  std::map<int, int> stdmap;
+  t_rbtree tree = rb_create_tree();
+  long found = 0;
+
+  for (int i = 0; i < size; ++i) {
+    keys[i] = containers[i].key = rng() % (size * 3);
+  }
+  std::cout << "branch misses: " << size << " random keys\n";
+  long long rb_insert_misses = count_branch_misses([&] {
+    for (auto& c : containers) rb_insert(&tree, &c.node, rb_less);
+  });
+  long long map_insert_misses = count_branch_misses([&] {
+    for (int key : keys) stdmap.emplace(key, key);
+  });
+  std::shuffle(keys.begin(), keys.end(), rng);
+  long long rb_find_misses = count_branch_misses([&] {
+    for (int key : keys) found += rb_find(reinterpret_cast<void*>(static_cast<long int>(key)), &tree, rb_compare) != NULL;
+  });
+  long long rb_bound_misses = count_branch_misses([&] {
+    for (int key : keys) found += rb_lower_bound(reinterpret_cast<void*>(static_cast<long int>(key)), &tree, rb_compare) != NULL;
+  });
+  long long map_find_misses = count_branch_misses([&] {
+    for (int key : keys) found += stdmap.find(key) != stdmap.end();
+  });
+  assert(found == 3L * size);
+  print_misses("rb_insert", rb_insert_misses, size);
+  print_misses("std::map insert", map_insert_misses, size);
+  print_misses("rb_find", rb_find_misses, size);
+  print_misses("rb_lower_bound", rb_bound_misses, size);
+  print_misses("std::map find", map_find_misses, size);
+  double rb_time = measure([&] {
+    for (int key : keys) found += rb_find(reinterpret_cast<void*>(static_cast<long int>(key)), &tree, rb_compare) != NULL;
+  });
+  double map_time = measure([&] {
+    for (int key : keys) found += stdmap.find(key) != stdmap.end();
+  });
+  assert(found == 5L * size);
+  print_ratio("find", rb_time, map_time, "map");
+  std::cout << '\n';
+}
+
+// rb::map against std::map, and the inlined comparator against the function pointer path.
+void bench_template_map(bool quick)
+{
+  int size = quick ? 1 << 10 : 1 << 20;
+  std::vector<int> keys(size);
+  std::minstd_rand rng(size);
+  rb::map<int, int> rbmap;
+  std::map<int, int> stdmap;
+  long int sum = 0;
+
+  for (int i = 0; i < size; ++i) {
+    keys[i] = rng() % (size * 3);
+  }
+  std::cout << "template map: " << size << " random keys\n";
+  // let the allocator grow its heap first so neither side pays for page faults.
+  {
+    std::map<int, int> warm_up;
+    for (int key : keys) warm_up.emplace(key, key);
+  }
+
+  double rb_time = measure([&] {
+    for (int key : keys) rbmap.emplace(key, key * key);
+  });
+  double map_time = measure([&] {
+    for (int key : keys) stdmap.emplace(key, key * key);
+  });
+  print_ratio("insert", rb_time, map_time, "map");
+  assert(rbmap.size() == stdmap.size());
+  assert(std::equal(rbmap.begin(), rbmap.end(), stdmap.begin()));
+  assert(std::equal(rbmap.rbegin(), rbmap.rend(), stdmap.rbegin()));
+
+  rb_time = measure([&] {
+    for (int key : keys) sum += rbmap.find(key)->second;
+  });
+  map_time = measure([&] {
+    for (int key : keys) sum -= stdmap.find(key)->second;
+  });
+  print_ratio("find", rb_time, map_time, "map");
+  assert(sum == 0);
+
+  for (int i = 0; i < size; i += 7) {
+    int key = keys[i] + 1;
+    assert((rbmap.lower_bound(key) == rbmap.end()) == (stdmap.lower_bound(key) == stdmap.end()));
+    assert(rbmap.lower_bound(key) == rbmap.end() || rbmap.lower_bound(key)->first == stdmap.lower_bound(key)->first);
+    assert(rbmap.upper_bound(key) == rbmap.end() || rbmap.upper_bound(key)->first == stdmap.upper_bound(key)->first);
+  }
+
+  rb_time = measure([&] {
+    for (int key : keys) rbmap.erase(key);
+  });
+  map_time = measure([&] {
+    for (int key : keys) stdmap.erase(key);
+  });
+  print_ratio("erase", rb_time, map_time, "map");
+  assert(rbmap.empty() && stdmap.empty());
+
+  // same intrusive nodes, comparator inlined or called through t_less/t_compare.
+  std::vector<t_container> containers(size);
+  t_intrusive_tree  itree;
+  t_rbtree          tree = rb_create_tree();
+
+  for (int i = 0; i < size; ++i) {
+    containers[i].key = keys[i];
+  }
+  double template_time = measure([&] {
+    for (auto& c : containers) itree.insert(c);
+  });
+  itree.clear();
+  double pointer_time = measure([&] {
+    for (auto& c : containers) rb_insert(&tree, &c.node, rb_less);
+  });
+  print_ratio("intrusive insert", template_time, pointer_time, "function pointer");
+
+  for (auto& c : containers) itree.insert(c);
+  template_time = measure([&] {
+    for (int key : keys) sum += itree.find(key)->key;
+  });
+  pointer_time = measure([&] {
+    for (int key : keys) sum -= container_of(rb_find(reinterpret_cast<void*>(key), &tree, rb_compare), t_container, node)->key;
+  });
+  print_ratio("intrusive find", template_time, pointer_time, "function pointer");
+  assert(sum == 0);
+  std::cout << '\n';
+}
+
+typedef struct entity {
+  t_rbnode  node;
+  uint64_t  vruntime;
+} t_entity;
+
+RB_GENERATE(entity_tree, t_entity, node, uint64_t, vruntime)
+
+bool  entity_less(t_rbnode* n1, const t_rbnode* n2)
+{
+  return entity_tree_entry(n1)->vruntime < entity_tree_entry(n2)->vruntime;
+}
+
+int   entity_compare(const void* key, const t_rbnode* node)
+{
+  uint64_t k = *static_cast<const uint64_t*>(key);
+  uint64_t vruntime = entity_tree_entry(node)->vruntime;
+
+  return (k > vruntime) - (k < vruntime);
+}
+
+// RB_GENERATE functions against the function pointer path on uint64_t keys.
+void bench_generated_tree(bool quick)
+{
+  int size = quick ? 1 << 10 : 1 << 20;
+  std::vector<t_entity> entities(size);
+  std::mt19937_64 rng(size);
+  t_rbtree generated = rb_create_tree();
+  t_rbtree pointer = rb_create_tree();
+  std::vector<t_entity> copies;
+
+  for (auto& e : entities) {
+    e.vruntime = rng() % (size * 3ull);
+  }
+  copies = entities;
+  std::cout << "generated tree: " << size << " uint64_t keys\n";
+
+  double generated_time = measure([&] {
+    for (auto& e : entities) entity_tree_insert(&generated, &e);
+  });
+  double pointer_time = measure([&] {
+    for (auto& e : copies) rb_insert(&pointer, &e.node, entity_less);
+  });
+  print_ratio("insert", generated_time, pointer_time, "function pointer");
+
+  uint64_t sum = 0;
+  generated_time = measure([&] {
+    for (auto& e : entities) sum += entity_tree_find(&generated, e.vruntime)->vruntime;
+  });
+  pointer_time = measure([&] {
+    for (auto& e : copies) sum -= entity_tree_entry(rb_find(&e.vruntime, &pointer, entity_compare))->vruntime;
+  });
+  print_ratio("find", generated_time, pointer_time, "function pointer");
+  assert(sum == 0);
+
+  for (int i = 0; i < size; i += 7) {
+    uint64_t key = entities[i].vruntime + 1;
+    t_entity* lower = entity_tree_lower_bound(&generated, key);
+    assert(lower == NULL || lower->vruntime >= key);
+    assert(entity_tree_find(&generated, key) == NULL || entity_tree_find(&generated, key)->vruntime == lower->vruntime);
+  }
+  for (auto& e : entities) {
+    entity_tree_erase(&generated, &e);
+  }
+  assert(generated.root == rb_nil);
+  std::cout << '\n';
+}
+
+// run queue ticks: take the entity with the smallest vruntime, charge it a slice and requeue it.
+void bench_pick_next(bool quick)
+{
+  int size = quick ? 1 << 8 : 1 << 14;
+  int ticks = quick ? 1 << 12 : 1 << 22;
+  std::vector<t_entity> entities(size);
+  std::vector<uint64_t> slices(ticks);
+  std::minstd_rand rng(size);
+  t_rbtree_cached tree = rb_create_tree_cached();
+  typedef std::pair<uint64_t, int> t_item;
+  std::priority_queue<t_item, std::vector<t_item>, std::greater<t_item> > heap;
+  std::set<t_item> set;
+  uint64_t rb_sum = 0;
+  uint64_t heap_sum = 0;
+  uint64_t set_sum = 0;
+
+  for (int i = 0; i < ticks; ++i) {
+    slices[i] = 1 + rng() % 1000;
+  }
+  for (int i = 0; i < size; ++i) {
+    entities[i].vruntime = rng() % 1000;
+    rb_insert_cached(&tree, &entities[i].node, entity_less);
+    heap.push(t_item(entities[i].vruntime, i));
+    set.insert(t_item(entities[i].vruntime, i));
+  }
+  std::cout << "pick next: " << size << " entities, " << ticks << " ticks\n";
+
+  double rb_time = measure([&] {
+    for (int i = 0; i < ticks; ++i) {
+      t_entity* e = entity_tree_entry(rb_pop_first(&tree));
+      rb_sum += e->vruntime;
+      e->vruntime += slices[i];
+      rb_insert_cached(&tree, &e->node, entity_less);
+    }
+  });
+  double heap_time = measure([&] {
+    for (int i = 0; i < ticks; ++i) {
+      t_item item = heap.top();
+      heap.pop();
+      heap_sum += item.first;
+      item.first += slices[i];
+      heap.push(item);
+    }
+  });
+  double set_time = measure([&] {
+    for (int i = 0; i < ticks; ++i) {
+      t_item item = *set.begin();
+      set.erase(set.begin());
+      set_sum += item.first;
+      item.first += slices[i];
+      set.insert(item);
+    }
+  });
+  print_ratio("pop_first", rb_time, heap_time, "priority_queue");
+  print_ratio("pop_first", rb_time, set_time, "set");
+  // ties may be picked in a different order, but the picked vruntimes must match.
+  assert(rb_sum == heap_sum && rb_sum == set_sum);
+
+  double erase_time = measure([&] {
+    for (int i = 0; i < ticks; ++i) {
+      t_entity* e = entity_tree_entry(rb_leftmost(&tree));
+      rb_erase_cached(&tree, &e->node);
+      e->vruntime += slices[i];
+      rb_insert_cached(&tree, &e->node, entity_less);
+    }
+  });
+  print_ratio("pop_first", rb_time, erase_time, "erase_cached");
+
+  // draining from both ends must meet in the middle in sorted order.
+  uint64_t low = 0;
+  uint64_t high = UINT64_MAX;
+  for (int i = 0; i < size; ++i) {
+    t_entity* e = entity_tree_entry(i % 2 ? rb_pop_last(&tree) : rb_pop_first(&tree));
+    if (i % 2) {
+      assert(e->vruntime <= high);
+      high = e->vruntime;
+    } else {
+      assert(e->vruntime >= low);
+      low = e->vruntime;
+    }
+  }
+  t_rbnode* first = rb_pop_first(&tree);
+  t_rbnode* last = rb_pop_last(&tree);
+  assert(low <= high && first == NULL && last == NULL);
+  assert(tree.rbtree.root == rb_nil);
+  std::cout << '\n';
+}
+
+static bool  is_sorted_tree(t_rbtree* tree, size_t size)
+{
+  size_t count = 0;
+
+  for (t_rbnode* node = rb_first(tree); node != NULL; node = rb_next(node), ++count) {
+    t_rbnode* next = rb_next(node);
+    if (next != NULL && entity_less(next, node)) {
+      return false;
+    }
+  }
+  return count == size;
+}
+
+// sequential, reverse and nearly sorted streams through a plain descent, the cached ends and a hint.
+void bench_sorted_insert(bool quick)
+{
+  int size = quick ? 1 << 10 : 1 << 20;
+  std::vector<t_entity> entities(size);
+  std::minstd_rand rng(size);
+  const char* names[] = {"sequential", "reverse", "nearly sorted"};
+
+  std::cout << "sorted insert: " << size << " keys\n";
+  for (int stream = 0; stream < 3; ++stream) {
+    for (int i = 0; i < size; ++i) {
+      entities[i].vruntime = stream == 1 ? size - i : i;
+    }
+    // swap a few close neighbours
+    if (stream == 2) {
+      for (int i = 0; i + 8 < size; i += 16) {
+        std::swap(entities[i].vruntime, entities[i + rng() % 8].vruntime);
+      }
+    }
+
+    t_rbtree plain = rb_create_tree();
+    double plain_time = measure([&] {
+      for (auto& e : entities) rb_insert(&plain, &e.node, entity_less);
+    });
+    assert(is_sorted_tree(&plain, size));
+
+    t_rbtree_cached cached = rb_create_tree_cached();
+    double cached_time = measure([&] {
+      for (auto& e : entities) rb_insert_cached(&cached, &e.node, entity_less);
+    });
+    assert(is_sorted_tree(&cached.rbtree, size));
+
+    t_rbtree hinted = rb_create_tree();
+    t_rbnode* hint = NULL;
+    double hint_time = measure([&] {
+      for (auto& e : entities) {
+        rb_insert_hint(&hinted, &e.node, hint, entity_less);
+        hint = &e.node;
+      }
+    });
+    assert(is_sorted_tree(&hinted, size));
+
+    t_rbtree_cached hinted_cached = rb_create_tree_cached();
+    hint = NULL;
+    double hint_cached_time = measure([&] {
+      for (auto& e : entities) {
+        rb_insert_hint_cached(&hinted_cached, &e.node, hint, entity_less);
+        hint = &e.node;
+      }
+    });
+    assert(is_sorted_tree(&hinted_cached.rbtree, size));
+    assert(hinted_cached.leftmost_node == rb_first(&hinted_cached.rbtree));
+    assert(hinted_cached.rightmost_node == rb_last(&hinted_cached.rbtree));
+
+    std::cout << names[stream] << ": ";
+    print_ratio("cached", cached_time, plain_time, "plain");
+    std::cout << names[stream] << ": ";
+    print_ratio("hint", hint_time, plain_time, "plain");
+    std::cout << names[stream] << ": ";
+    print_ratio("cached hint", hint_cached_time, plain_time, "plain");
+  }
+  std::cout << '\n';
+}
+
+static long int compare_count = 0;
+
+static bool counting_less(t_rbnode* n1, const t_rbnode* n2)
+{
+  ++compare_count;
+  return rb_less(n1, n2);
+}
+
+static int  counting_compare(const void* key, const t_rbnode* node)
+{
+  ++compare_count;
+  return rb_compare(key, node);
+}
+
+static void free_container(t_rbnode* node)
+{
+  free(container_of(node, t_container, node));
+}
+
+// ingest with many duplicate keys: rb_find + rb_insert against the single descent inserts.
+void bench_insert_unique(bool quick)
+{
+  int size = quick ? 1 << 10 : 1 << 20;
+  std::vector<int> keys(size);
+  std::minstd_rand rng(size);
+  std::set<int> unique;
+
+  for (int i = 0; i < size; ++i) {
+    keys[i] = rng() % (size / 4);
+    unique.insert(keys[i]);
+  }
+  std::cout << "insert unique: " << size << " keys, " << unique.size() << " distinct\n";
+
+  // each tree is checked and freed before the next run, which then starts from the same heap
+  std::map<int, int> expected;
+  for (int key : unique) {
+    expected[key] = 0;
+  }
+
+  t_rbtree two_pass = rb_create_tree();
+  double two_pass_time;
+  compare_count = 0;
+  long long two_pass_misses = count_cache_misses([&] {
+    two_pass_time = measure([&] {
+      for (int key : keys) {
+        if (rb_find(reinterpret_cast<void*>(key), &two_pass, counting_compare) != NULL) continue;
+        t_container* c = static_cast<t_container*>(malloc(sizeof(t_container)));
+        c->key = key;
+        rb_insert(&two_pass, &c->node, counting_less);
+      }
+    });
+  });
+  long int two_pass_count = compare_count;
+  assert(check_equal(&two_pass, expected));
+  rb_postorder_foreach(two_pass.root, free_container);
+
+  // the probe node is allocated up front and freed on a collision.
+  t_rbtree unique_tree = rb_create_tree();
+  double unique_time;
+  compare_count = 0;
+  long long unique_misses = count_cache_misses([&] {
+    unique_time = measure([&] {
+      for (int key : keys) {
+        t_container* c = static_cast<t_container*>(malloc(sizeof(t_container)));
+        c->key = key;
+        if (rb_insert_unique(&unique_tree, &c->node, counting_less) != NULL) free(c);
+      }
+    });
+  });
+  long int unique_count = compare_count;
+  assert(check_equal(&unique_tree, expected));
+  rb_postorder_foreach(unique_tree.root, free_container);
+
+  // the node is allocated only when the key is missing.
+  t_rbtree key_tree = rb_create_tree();
+  double key_time;
+  compare_count = 0;
+  long long key_misses = count_cache_misses([&] {
+    key_time = measure([&] {
+      for (int key : keys) {
+        t_rbnode*   parent;
+        t_rbnode**  link;
+        if (rb_find_insert_pos(reinterpret_cast<void*>(key), &key_tree, counting_compare, &parent, &link) != NULL) continue;
+        t_container* c = static_cast<t_container*>(malloc(sizeof(t_container)));
+        c->key = key;
+        rb_insert_at(&key_tree, &c->node, parent, link);
+      }
+    });
+  });
+  long int key_count = compare_count;
+
+  print_ratio("insert_unique", unique_time, two_pass_time, "find + insert");
+  print_ratio("find_insert_pos", key_time, two_pass_time, "find + insert");
+  std::cout << "comparisons: find + insert = " << two_pass_count << ", insert_unique = " << unique_count;
+  std::cout << ", find_insert_pos = " << key_count << '\n';
+  print_misses("find + insert", two_pass_misses, size, "cache misses");
+  print_misses("insert_unique", unique_misses, size, "cache misses");
+  print_misses("find_insert_pos", key_misses, size, "cache misses");
+
+  assert(check_equal(&key_tree, expected));
+
+  t_container* probe = static_cast<t_container*>(malloc(sizeof(t_container)));
+  probe->key = *unique.begin();
+  t_rbnode* existing = rb_insert_unique_key(&key_tree, reinterpret_cast<void*>(probe->key), &probe->node, rb_compare);
+  if (existing == NULL) {
+    std::cout << "insert_unique_key duplicate: fail\n";
+  } else {
+    probe->key = *unique.rbegin() + 1;
+    t_rbnode* linked = rb_insert_unique_key(&key_tree, reinterpret_cast<void*>(probe->key), &probe->node, rb_compare);
+    if (linked != NULL) {
+      std::cout << "insert_unique_key new key: fail\n";
+      free(probe);
+    } else if (rb_last(&key_tree) != &probe->node) {
+      std::cout << "insert_unique_key new key: fail\n";
+    }
+  }
+
+  rb_postorder_foreach(key_tree.root, free_container);
+  std::cout << '\n';
+}
+
+// black height of a valid subtree, -1 if a red node has a red child,
+// black heights differ or a parent link is broken.
+static int  black_height(t_rbnode* node)
+{
+  if (node == rb_nil) {
+    return 0;
+  }
+  int left = black_height(node->left);
+  int right = black_height(node->right);
+  bool red = node->pc.color;
+  bool broken_link = (node->left != rb_nil && (t_rbnode*)((uintptr_t)node->left->pc.parent & ~1) != node)
+                     || (node->right != rb_nil && (t_rbnode*)((uintptr_t)node->right->pc.parent & ~1) != node);
+
+  if (left < 0 || left != right || broken_link || (red && (node->left->pc.color || node->right->pc.color))) {
+    return -1;
+  }
+  return left + !red;
+}
+
+static bool is_valid_tree(t_rbtree* tree)
+{
+  return tree->root == rb_nil || (tree->root->pc.color == 0 && black_height(tree->root) >= 0);
+}
+
+// warm start from a sorted snapshot: O(n) build against n inserts.
+void bench_build_sorted(bool quick)
+{
+  size_t size = quick ? 1000 : 10000000;
+  std::vector<t_entity> entities(size);
+  std::vector<t_rbnode*> nodes(size);
+
+  for (size_t i = 0; i < size; ++i) {
+    entities[i].vruntime = i / 3;
+    nodes[i] = &entities[i].node;
+  }
+  std::cout << "build sorted: " << size << " nodes\n";
+
+  t_rbtree_cached built = rb_create_tree_cached();
+  double build_time = measure([&] {
+    rb_build_sorted_cached(&built, nodes.data(), size);
+  });
+  assert(is_sorted_tree(&built.rbtree, size) && is_valid_tree(&built.rbtree));
+  assert(rb_leftmost(&built) == rb_first(&built.rbtree) && rb_rightmost(&built) == rb_last(&built.rbtree));
+  // equal keys keep the array order
+  for (size_t i = 0; i + 1 < size; ++i) {
+    assert(rb_next(nodes[i]) == nodes[i + 1]);
+  }
+
+  t_rbtree inserted = rb_create_tree();
+  double insert_time = measure([&] {
+    for (auto& e : entities) rb_insert(&inserted, &e.node, entity_less);
+  });
+
+  t_rbtree_cached appended = rb_create_tree_cached();
+  double append_time = measure([&] {
+    for (auto& e : entities) rb_insert_cached(&appended, &e.node, entity_less);
+  });
+  print_ratio("build_sorted", build_time, insert_time, "insert");
+  print_ratio("build_sorted", build_time, append_time, "insert_cached");
+
+  // every size up to a few perfect trees must color correctly.
+  for (size_t n = 0; n < std::min<size_t>(size, 300); ++n) {
+    t_rbtree tree = rb_create_tree();
+    rb_build_sorted(&tree, nodes.data(), n);
+    assert(is_valid_tree(&tree) && is_sorted_tree(&tree, n));
+  }
+  std::cout << '\n';
+}
+
+static std::vector<int> tree_keys(t_rbtree* tree)
+{
+  std::vector<int> keys;
+
+  for (t_rbnode* node = rb_first(tree); node != NULL; node = rb_next(node)) {
+    keys.push_back(container_of(node, t_container, node)->key);
+  }
+  return keys;
+}
+
+static t_rbtree make_tree(std::vector<t_container>& containers, const std::vector<int>& keys)
+{
+  t_rbtree tree = rb_create_tree();
+
+  containers.resize(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    containers[i].key = keys[i];
+    rb_insert(&tree, &containers[i].node, rb_less);
+  }
+  return tree;
+}
+
+static std::vector<int> random_unique_keys(size_t size, int range, std::minstd_rand& rng)
+{
+  std::unordered_set<int> table;
+  std::vector<int> keys;
+
+  while (keys.size() < size) {
+    int key = rng() % range;
+    if (table.insert(key).second) {
+      keys.push_back(key);
+    }
+  }
+  return keys;
+}
+
+static std::atomic<long> drop_count(0);
+
+static void count_drop(t_rbnode*)
+{
+  ++drop_count;
+}
+
+bool  check_join_split(bool quick)
+{
+  int size = quick ? 1 << 14 : 1 << 18;
+  std::minstd_rand rng(size);
+  std::vector<t_container> containers;
+  std::vector<int> keys = random_unique_keys(size, size * 4, rng);
+  t_rbtree tree = make_tree(containers, keys);
+  std::vector<int> sorted = keys;
+
+  std::sort(sorted.begin(), sorted.end());
+  for (int round = 0; round < 64; ++round) {
+    int key = rng() % (size * 4);
+    t_rbtree lt;
+    t_rbtree ge;
+
+    rb_split(&tree, reinterpret_cast<void*>(key), rb_compare, &lt, &ge);
+    std::vector<int> lt_keys = tree_keys(&lt);
+    std::vector<int> ge_keys = tree_keys(&ge);
+    size_t lt_size = std::lower_bound(sorted.begin(), sorted.end(), key) - sorted.begin();
+    if (tree.root != rb_nil || !is_valid_tree(&lt) || !is_valid_tree(&ge) || lt_keys.size() != lt_size
+        || !std::equal(lt_keys.begin(), lt_keys.end(), sorted.begin())
+        || !std::equal(ge_keys.begin(), ge_keys.end(), sorted.begin() + lt_size)) {
+      std::cout << "split at " << key << " failed\n";
+      return false;
+    }
+    // join back with the first node of ge, or the last of lt, as pivot.
+    t_rbnode* pivot = ge.root != rb_nil ? rb_first(&ge) : rb_last(&lt);
+    rb_erase(ge.root != rb_nil ? &ge : &lt, pivot);
+    rb_join(&lt, pivot, &ge);
+    if (ge.root != rb_nil || !is_valid_tree(&lt) || tree_keys(&lt) != sorted) {
+      std::cout << "join at " << key << " failed\n";
+      return false;
+    }
+    tree = lt;
+  }
+
+  // set operations against std::set_*.
+  rb_set_threads(4);
+  for (int kind = 0; kind < 3; ++kind) {
+    std::vector<t_container> c1;
+    std::vector<t_container> c2;
+    std::vector<int> k1 = random_unique_keys(size, size * 2, rng);
+    std::vector<int> k2 = random_unique_keys(size / (kind + 1), size * 2, rng);
+    t_rbtree t1 = make_tree(c1, k1);
+    t_rbtree t2 = make_tree(c2, k2);
+    std::vector<int> expected;
+
+    std::sort(k1.begin(), k1.end());
+    std::sort(k2.begin(), k2.end());
+    drop_count = 0;
+    if (kind == 0) {
+      rb_union(&t1, &t2, rb_less, count_drop);
+      std::set_union(k1.begin(), k1.end(), k2.begin(), k2.end(), std::back_inserter(expected));
+    } else if (kind == 1) {
+      rb_intersection(&t1, &t2, rb_less, count_drop);
+      std::set_intersection(k1.begin(), k1.end(), k2.begin(), k2.end(), std::back_inserter(expected));
+    } else {
+      rb_difference(&t1, &t2, rb_less, count_drop);
+      std::set_difference(k1.begin(), k1.end(), k2.begin(), k2.end(), std::back_inserter(expected));
+    }
+    if (t2.root != rb_nil || !is_valid_tree(&t1) || tree_keys(&t1) != expected
+        || static_cast<size_t>(drop_count) != k1.size() + k2.size() - expected.size()) {
+      std::cout << "set operation " << kind << " failed\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// union of two trees: join-based over 1..N threads against moving nodes one by one.
+void bench_union(bool quick)
+{
+  int size = quick ? 1 << 14 : 1 << 21;
+  int max_threads = quick ? 2 : std::max(1u, std::thread::hardware_concurrency());
+  std::minstd_rand rng(size);
+  std::vector<int> k1 = random_unique_keys(size, size * 4, rng);
+  std::vector<int> k2 = random_unique_keys(size, size * 4, rng);
+  std::vector<t_container> c1;
+  std::vector<t_container> c2;
+
+  std::cout << "union: " << size << " + " << size << " nodes\n";
+  t_rbtree t1 = make_tree(c1, k1);
+  t_rbtree t2 = make_tree(c2, k2);
+  double base_time = measure([&] {
+    t_rbnode* node;
+    while ((node = rb_first(&t2)) != NULL) {
+      rb_erase(&t2, node);
+      rb_insert_unique(&t1, node, rb_less);
+    }
+  });
+  std::cout << "node by node = " << base_time << '\n';
+
+  for (int threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+    t1 = make_tree(c1, k1);
+    t2 = make_tree(c2, k2);
+    rb_set_threads(threads);
+    double union_time = measure([&] {
+      rb_union(&t1, &t2, rb_less, NULL);
+    });
+    std::cout << "threads = " << threads << ", ";
+    print_ratio("rb_union", union_time, base_time, "node by node");
+    if (threads == max_threads) {
+      break;
+    }
+  }
+  std::cout << '\n';
+}
+
+typedef struct weighted {
+  t_rbnode  node;
+  int       key;
+  int       weight;
+  int       max_weight;
+} t_weighted;
+
+static int  max_weight_compute(const t_weighted* w)
+{
+  int max = w->weight;
+
+  if (w->node.left != rb_nil) {
+    max = std::max(max, container_of(w->node.left, t_weighted, node)->max_weight);
+  }
+  if (w->node.right != rb_nil) {
+    max = std::max(max, container_of(w->node.right, t_weighted, node)->max_weight);
+  }
+  return max;
+}
+
+RB_GENERATE_AUGMENT(max_weight_augment, t_weighted, node, max_weight, max_weight_compute)
+
+bool  weighted_less(t_rbnode* n1, const t_rbnode* n2)
+{
+  return container_of(n1, t_weighted, node)->key < container_of(n2, t_weighted, node)->key;
+}
+
+// every node holds the maximum weight of its subtree
+static bool is_augmented(t_rbnode* node)
+{
+  if (node == rb_nil) {
+    return true;
+  }
+  t_weighted* w = container_of(node, t_weighted, node);
+  return w->max_weight == max_weight_compute(w) && is_augmented(node->left) && is_augmented(node->right);
+}
+
+// random inserts and erases checked against a full recomputation,
+// then augmented insert/erase against the plain ones and the maximum
+// from the root against a walk.
+void bench_augmented(bool quick)
+{
+  int size = quick ? 1 << 10 : 1 << 20;
+  std::minstd_rand rng(size);
+  std::vector<t_weighted> items(size);
+  std::multiset<int> weights;
+  t_rbtree tree = rb_create_tree();
+
+  std::cout << "augmented: " << size << " nodes\n";
+  for (int i = 0; i < size; ++i) {
+    items[i].key = rng() % size;
+    items[i].weight = rng() % (size * 4);
+  }
+  for (int round = 0; round < 4; ++round) {
+    for (int i = 0; i < size; ++i) {
+      if (round % 2 == 1 && i % 2 == 0) {
+        rb_erase_augmented(&tree, &items[i].node, &max_weight_augment);
+        weights.erase(weights.find(items[i].weight));
+      } else if (round % 2 == 0 && (round == 0 || i % 2 == 0)) {
+        rb_insert_augmented(&tree, &items[i].node, weighted_less, &max_weight_augment);
+        weights.insert(items[i].weight);
+      }
+      if (quick || i % 4096 == 0) {
+        if (!is_valid_tree(&tree) || !is_augmented(tree.root)
+            || container_of(tree.root, t_weighted, node)->max_weight != *weights.rbegin()) {
+          std::cout << "augmented round " << round << ": fail\n";
+          return;
+        }
+      }
+    }
+  }
+
+  tree = rb_create_tree();
+  double aug_time = measure([&] {
+    for (auto& w : items) rb_insert_augmented(&tree, &w.node, weighted_less, &max_weight_augment);
+    for (auto& w : items) rb_erase_augmented(&tree, &w.node, &max_weight_augment);
+  });
+  double plain_time = measure([&] {
+    for (auto& w : items) rb_insert(&tree, &w.node, weighted_less);
+    for (auto& w : items) rb_erase(&tree, &w.node);
+  });
+  print_ratio("insert + erase augmented", aug_time, plain_time, "plain");
+
+  for (auto& w : items) rb_insert_augmented(&tree, &w.node, weighted_less, &max_weight_augment);
+  int walk_max = 0;
+  double walk_time = measure([&] {
+    for (t_rbnode* node = rb_first(&tree); node != NULL; node = rb_next(node)) {
+      walk_max = std::max(walk_max, container_of(node, t_weighted, node)->weight);
+    }
+  });
+  int root_max = 0;
+  double root_time = measure([&] {
+    root_max = container_of(tree.root, t_weighted, node)->max_weight;
+  });
+  assert(root_max == walk_max);
+  print_ratio("max weight from root", root_time, walk_time, "walk");
+  std::cout << '\n';
+}
+
+typedef struct ranked {
+  t_rbnode_os os;
+  int         key;
+} t_ranked;
+
+bool  ranked_less(t_rbnode* n1, const t_rbnode* n2)
+{
+  return container_of(n1, t_ranked, os.node)->key < container_of(n2, t_ranked, os.node)->key;
+}
+
+int   ranked_compare(const void* key, const t_rbnode* node)
+{
+  int k = static_cast<int>(reinterpret_cast<uintptr_t>(key));
+  int other = container_of(node, t_ranked, os.node)->key;
+  return (k > other) - (k < other);
+}
+
+static int  ranked_key(t_rbnode_os* node)
+{
+  return container_of(node, t_ranked, os)->key;
+}
+
+// rank, select and size against a sorted vector, then percentile and
+// rank queries against scanning from rb_first.
+void bench_order_statistics(bool quick)
+{
+  int size = quick ? 1 << 10 : 1 << 20;
+  int queries = 16;
+  std::minstd_rand rng(size);
+  std::vector<t_ranked> items(size);
+  std::vector<int> sorted;
+  t_rbtree_os tree = rb_create_tree_os();
+
+  std::cout << "order statistics: " << size << " nodes\n";
+  for (auto& item : items) {
+    item.key = rng() % size;
+  }
+  // insert all, then erase the odd ones, checking against the sorted present keys
+  std::vector<bool> present(size, false);
+  for (int round = 0; round < 2; ++round) {
+    for (int i = round; i < size; i += round + 1) {
+      if (round == 0) {
+        rb_os_insert(&tree, &items[i].os, ranked_less);
+      } else {
+        rb_os_erase(&tree, &items[i].os);
+      }
+      present[i] = round == 0;
+      if (quick || i % 65536 == 0) {
+        sorted.clear();
+        for (int j = 0; j < size; ++j) {
+          if (present[j]) sorted.push_back(items[j].key);
+        }
+        std::sort(sorted.begin(), sorted.end());
+        int k = rng() % sorted.size();
+        t_rbnode_os* node = rb_select(&tree, k);
+        size_t less = std::lower_bound(sorted.begin(), sorted.end(), k) - sorted.begin();
+        if (rb_size(&tree) != sorted.size() || node == NULL || ranked_key(node) != sorted[k]
+            || rb_rank(node) != static_cast<size_t>(k) || rb_select(&tree, sorted.size()) != NULL
+            || rb_count_less(reinterpret_cast<void*>(k), &tree, ranked_compare) != less) {
+          std::cout << "order statistics round " << round << ": fail\n";
+          return;
+        }
+      }
+    }
+  }
+  if (!is_valid_tree(&tree.rbtree)) {
+    std::cout << "order statistics: invalid tree\n";
+    return;
+  }
+
+  // p50 and p99 of the queue
+  size_t n = rb_size(&tree);
+  long select_sum = 0;
+  double select_time = measure([&] {
+    for (int q = 0; q < queries; ++q) {
+      select_sum += ranked_key(rb_select(&tree, n / 2)) + ranked_key(rb_select(&tree, n * 99 / 100));
+    }
+  });
+  long scan_sum = 0;
+  double scan_time = measure([&] {
+    for (int q = 0; q < queries; ++q) {
+      size_t i = 0;
+      for (t_rbnode* node = rb_first(&tree.rbtree); i <= n * 99 / 100; node = rb_next(node), ++i) {
+        if (i == n / 2 || i == n * 99 / 100) {
+          scan_sum += container_of(node, t_ranked, os.node)->key;
+        }
+      }
+    }
+  });
+  assert(select_sum == scan_sum);
+  print_ratio("p50 + p99", select_time, scan_time, "scan");
+
+  // rank of present nodes, the odd ones were erased
+  size_t rank_sum = 0;
+  double rank_time = measure([&] {
+    for (int q = 0; q < queries; ++q) {
+      rank_sum += rb_rank(&items[(q * 2) % size].os);
+    }
+  });
+  size_t walk_sum = 0;
+  double walk_time = measure([&] {
+    for (int q = 0; q < queries; ++q) {
+      t_rbnode* target = &items[(q * 2) % size].os.node;
+      size_t i = 0;
+      for (t_rbnode* node = rb_first(&tree.rbtree); node != target; node = rb_next(node)) {
+        ++i;
+      }
+      walk_sum += i;
+    }
+  });
+  assert(rank_sum == walk_sum);
+  print_ratio("rank", rank_time, walk_time, "scan");
+  std::cout << '\n';
+}
+
+static bool is_interval_augmented(t_rbnode* node, int64_t* subtree_last)
+{
+  if (node == rb_nil) {
+    *subtree_last = INT64_MIN;
+    return true;
+  }
+  t_rbinterval* interval = container_of(node, t_rbinterval, node);
+  int64_t left = INT64_MIN;
+  int64_t right = INT64_MIN;
+  bool valid = is_interval_augmented(node->left, &left) && is_interval_augmented(node->right, &right);
+  *subtree_last = std::max(interval->last, std::max(left, right));
+  return valid && interval->subtree_last == *subtree_last;
+}
+
+// hits of [start, last] as (start, last, sum of starts), to compare with brute force
+static std::vector<int64_t> interval_hits(t_rbtree* tree, int64_t start, int64_t last)
+{
+  int64_t count = 0;
+  int64_t sum = 0;
+  int64_t prev = INT64_MIN;
+  bool sorted = true;
+
+  for (t_rbinterval* i = interval_iter_first(tree, start, last); i != NULL; i = interval_iter_next(i, start, last)) {
+    sorted = sorted && prev <= i->start;
+    prev = i->start;
+    ++count;
+    sum += i->start ^ i->last;
+  }
+  return {count, sum, sorted};
+}
+
+static std::vector<int64_t> brute_hits(const std::vector<t_rbinterval>& intervals,
+                                       const std::vector<bool>& present, int64_t start, int64_t last)
+{
+  int64_t count = 0;
+  int64_t sum = 0;
+
+  for (size_t i = 0; i < intervals.size(); ++i) {
+    if (present[i] && intervals[i].start <= last && start <= intervals[i].last) {
+      ++count;
+      sum += intervals[i].start ^ intervals[i].last;
+    }
+  }
+  return {count, sum, true};
+}
+
+// stabbing and overlap queries against scanning every interval.
+void bench_interval_tree(bool quick)
+{
+  int size = quick ? 1 << 12 : 1 << 20;
+  int queries = quick ? 64 : 256;
+  int64_t range = 1000000000;
+  std::minstd_rand rng(size);
+  std::vector<t_rbinterval> intervals(size);
+  std::vector<bool> present(size, true);
+  t_rbtree tree = rb_create_tree();
+
+  std::cout << "interval tree: " << size << " intervals\n";
+  for (auto& interval : intervals) {
+    interval.start = rng() % range;
+    // mostly short windows with a few long reservations
+    interval.last = interval.start + (rng() % 64 == 0 ? rng() % (range / 100) : rng() % 10000);
+    interval_insert(&tree, &interval);
+  }
+  // erase a quarter to exercise the erase path
+  for (int i = 0; i < size; i += 4) {
+    interval_erase(&tree, &intervals[i]);
+    present[i] = false;
+  }
+  int64_t subtree_last;
+  if (!is_valid_tree(&tree) || !is_interval_augmented(tree.root, &subtree_last)) {
+    std::cout << "interval tree: invalid tree\n";
+    return;
+  }
+
+  std::vector<std::pair<int64_t, int64_t>> ranges(queries);
+  for (int q = 0; q < queries; ++q) {
+    int64_t start = rng() % range;
+    ranges[q] = {start, q % 2 ? start : start + rng() % 100000};
+  }
+  for (auto& r : ranges) {
+    if (interval_hits(&tree, r.first, r.second) != brute_hits(intervals, present, r.first, r.second)) {
+      std::cout << "interval query [" << r.first << ", " << r.second << "]: fail\n";
+      return;
+    }
+  }
+
+  for (int stab = 1; stab >= 0; --stab) {
+    int64_t tree_count = 0;
+    double tree_time = measure([&] {
+      for (auto& r : ranges) {
+        int64_t last = stab ? r.first : r.second;
+        for (t_rbinterval* i = interval_iter_first(&tree, r.first, last); i; i = interval_iter_next(i, r.first, last)) {
+          ++tree_count;
+        }
+      }
+    });
+    int64_t brute_count = 0;
+    double brute_time = measure([&] {
+      for (auto& r : ranges) {
+        int64_t last = stab ? r.first : r.second;
+        for (int i = 0; i < size; ++i) {
+          brute_count += present[i] && intervals[i].start <= last && r.first <= intervals[i].last;
+        }
+      }
+    });
+    assert(tree_count == brute_count);
+    std::cout << (stab ? "stabbing" : "overlap") << ", " << tree_count << " hits: ";
+    print_ratio("interval tree", tree_time, brute_time, "scan");
+  }
+  std::cout << '\n';
+}
+
+static void postorder_reference(t_rbnode* node, std::vector<t_rbnode*>& order)
+{
+  if (node == rb_nil) {
+    return;
+  }
+  postorder_reference(node->left, order);
+  postorder_reference(node->right, order);
+  order.push_back(node);
+}
+
+static std::vector<t_rbnode*>* visit_order;
+
+static void record_visit(t_rbnode* node)
+{
+  visit_order->push_back(node);
+}
+
+static t_rbtree build_allocated(int size)
+{
+  std::vector<t_rbnode*> nodes(size);
+  t_rbtree tree = rb_create_tree();
+
+  for (int i = 0; i < size; ++i) {
+    t_container* c = static_cast<t_container*>(malloc(sizeof(t_container)));
+    c->key = i;
+    nodes[i] = &c->node;
+  }
+  rb_build_sorted(&tree, nodes.data(), size);
+  return tree;
+}
+
+// postorder iteration against recursion, then teardown against erasing node by node.
+void bench_destroy(bool quick)
+{
+  int size = quick ? 1 << 12 : 1 << 24;
+  std::vector<t_container> containers;
+  std::vector<int> keys(quick ? 1000 : 100000);
+  std::minstd_rand rng(size);
+
+  for (auto& key : keys) {
+    key = rng() % (keys.size() * 2);
+  }
+  t_rbtree tree = make_tree(containers, keys);
+  std::vector<t_rbnode*> expected;
+  std::vector<t_rbnode*> iterated;
+  std::vector<t_rbnode*> visited;
+  for (t_rbnode* node = rb_first_postorder(&tree); node != NULL; node = rb_next_postorder(node)) {
+    iterated.push_back(node);
+  }
+  postorder_reference(tree.root, expected);
+  visit_order = &visited;
+  // a subtree only visits its own nodes
+  rb_postorder_foreach(tree.root->left, record_visit);
+  if (iterated != expected || visited.size() == 0 || visited.back() != tree.root->left
+      || !std::equal(visited.begin(), visited.end(), expected.begin())) {
+    std::cout << "postorder: fail\n";
+    return;
+  }
+
+  std::cout << "destroy: " << size << " nodes\n";
+  tree = build_allocated(size);
+  double destroy_time = measure([&] {
+    rb_destroy(&tree, deallocate);
+  });
+  assert(tree.root == rb_nil);
+  tree = build_allocated(size);
+  // freeing in order would leave rb_next reading freed ancestors
+  double erase_time = measure([&] {
+    t_rbnode* node;
+    while ((node = rb_first(&tree)) != NULL) {
+      rb_erase(&tree, node);
+      free(container_of(node, t_container, node));
+    }
+  });
+  print_ratio("rb_destroy", destroy_time, erase_time, "rb_erase");
+  std::cout << '\n';
+}
+
+static std::vector<int>* handed_back;
+
+static void hand_back_val(t_rbnode* node)
+{
+  handed_back->push_back(container_of(node, t_container, node)->val);
+}
+
+// ranges against std::multimap, then expiring deadline windows against
+// erasing each expired node.
+void bench_erase_range(bool quick)
+{
+  int size = quick ? 1 << 12 : 1 << 20;
+  int range = size / 4;
+  std::minstd_rand rng(size);
+  std::vector<t_container> containers(size);
+  std::multimap<int, int> map;
+  std::vector<int> vals;
+  t_rbtree_cached tree = rb_create_tree_cached();
+
+  handed_back = &vals;
+  for (int i = 0; i < size; ++i) {
+    containers[i].key = rng() % range;
+    containers[i].val = i;
+    rb_insert_cached(&tree, &containers[i].node, rb_less);
+    map.insert(std::make_pair(containers[i].key, i));
+  }
+  for (int round = 0; round < 64; ++round) {
+    int lo = rng() % (range + 2) - 1;
+    int hi = lo + rng() % (range / 8);
+    auto first = map.lower_bound(lo);
+    auto last = map.lower_bound(hi);
+    std::vector<int> expected;
+    for (auto itr = first; itr != last; ++itr) {
+      expected.push_back(itr->second);
+    }
+    map.erase(first, last);
+    vals.clear();
+    rb_erase_range_cached(&tree, reinterpret_cast<void*>(lo), reinterpret_cast<void*>(hi), rb_compare, hand_back_val);
+    if (vals != expected || !is_valid_tree(&tree.rbtree) || tree.leftmost_node != rb_first(&tree.rbtree)
+        || tree.rightmost_node != rb_last(&tree.rbtree)) {
+      std::cout << "erase range [" << lo << ", " << hi << "): fail\n";
+      return;
+    }
+  }
+  // what is left comes back in order
+  std::vector<int> expected;
+  for (auto& entry : map) {
+    expected.push_back(entry.second);
+  }
+  vals.clear();
+  rb_clear_cached(&tree, hand_back_val);
+  if (vals != expected || tree.rbtree.root != rb_nil || tree.leftmost_node != NULL || tree.rightmost_node != NULL) {
+    std::cout << "clear: fail\n";
+    return;
+  }
+
+  // the same deadlines in two trees, expired one window at a time
+  std::vector<t_container> copies = containers;
+  int window = range / 64;
+  for (auto& c : containers) rb_insert_cached(&tree, &c.node, rb_less);
+  t_rbtree expiring = rb_create_tree();
+  for (auto& c : copies) rb_insert(&expiring, &c.node, rb_less);
+  std::cout << "erase range: " << size << " nodes, 64 windows\n";
+
+  // both hand every expired node to a callback
+  drop_count = 0;
+  double range_time = measure([&] {
+    for (int lo = 0; lo < range; lo += window) {
+      rb_erase_range_cached(&tree, reinterpret_cast<void*>(lo), reinterpret_cast<void*>(lo + window), rb_compare, count_drop);
+    }
+  });
+  double erase_time = measure([&] {
+    for (int lo = 0; lo < range; lo += window) {
+      void* hi = reinterpret_cast<void*>(lo + window);
+      t_rbnode* node = rb_lower_bound(reinterpret_cast<void*>(lo), &expiring, rb_compare);
+      while (node != NULL && rb_compare(hi, node) > 0) {
+        t_rbnode* next = rb_next(node);
+        rb_erase(&expiring, node);
+        count_drop(node);
+        node = next;
+      }
+    }
+  });
+  assert(tree.rbtree.root == rb_nil && tree.leftmost_node == NULL && expiring.root == rb_nil && drop_count == 2 * size);
+  print_ratio("rb_erase_range", range_time, erase_time, "rb_erase");
+  std::cout << '\n';
+}
+
+struct node_timing {
+  double insert;
+  double find;
+  double iterate;
+  double teardown;
+};
+
+static t_rbarena* free_arena;
+
+static void arena_free_container(t_rbnode* node)
+{
+  rb_arena_free(free_arena, container_of(node, t_container, node));
+}
+
+// random inserts, finds and a full walk with nodes from malloc or from @arena.
+static node_timing time_nodes(const std::vector<int>& keys, t_rbarena* arena)
+{
+  node_timing timing;
+  t_rbtree tree = rb_create_tree();
+  long sum = 0;
+  long found = 0;
+
+  timing.insert = measure([&] {
+    for (int key : keys) {
+      void* slot = arena ? rb_arena_alloc(arena) : malloc(sizeof(t_container));
+      t_container* c = static_cast<t_container*>(slot);
+      c->key = key;
+      rb_insert(&tree, &c->node, rb_less);
+    }
+  });
+  timing.find = measure([&] {
+    for (size_t i = 0; i < keys.size(); i += 3) {
+      found += rb_find(reinterpret_cast<void*>(keys[i]), &tree, rb_compare) != NULL;
+    }
+  });
+  timing.iterate = measure([&] {
+    for (t_rbnode* node = rb_first(&tree); node != NULL; node = rb_next(node)) {
+      sum += container_of(node, t_container, node)->key;
+    }
+  });
+  assert(found == static_cast<long>((keys.size() + 2) / 3) && sum != 0);
+  timing.teardown = measure([&] {
+    if (arena) {
+      rb_arena_destroy(arena);
+      tree = rb_create_tree();
+    } else {
+      rb_destroy(&tree, free_container);
+    }
+  });
+  return timing;
+}
+
+// arena slots against malloc at growing sizes.
+void bench_arena(bool quick)
+{
+  t_rbarena arena;
+  int small = 64;
+
+  // LIFO reuse, distinct aligned slots and a full arena
+  if (!rb_arena_init(&arena, sizeof(t_container), small, false)) {
+    std::cout << "arena: mmap failed\n";
+    return;
+  }
+  std::set<void*> slots;
+  for (int i = 0; i < small; ++i) {
+    void* slot = rb_arena_alloc(&arena);
+    assert(slot != NULL && reinterpret_cast<uintptr_t>(slot) % alignof(t_container) == 0);
+    slots.insert(slot);
+  }
+  void* overflow = rb_arena_alloc(&arena);
+  assert(slots.size() == static_cast<size_t>(small) && overflow == NULL);
+  void* first = *slots.begin();
+  void* last = *slots.rbegin();
+  rb_arena_free(&arena, first);
+  rb_arena_free(&arena, last);
+  void* reused_last = rb_arena_alloc(&arena);
+  void* reused_first = rb_arena_alloc(&arena);
+  assert(reused_last == last && reused_first == first);
+  rb_arena_reset(&arena);
+  void* reset = rb_arena_alloc(&arena);
+  assert(reset == arena.base);
+  // freed nodes go back to the arena through rb_destroy
+  std::vector<int> keys(small);
+  t_rbtree tree = rb_create_tree();
+  rb_arena_reset(&arena);
+  for (int i = 0; i < small; ++i) {
+    t_container* c = static_cast<t_container*>(rb_arena_alloc(&arena));
+    c->key = i;
+    rb_insert(&tree, &c->node, rb_less);
+  }
+  free_arena = &arena;
+  rb_destroy(&tree, arena_free_container);
+  int returned = 0;
+  while (rb_arena_alloc(&arena) != NULL) {
+    ++returned;
+  }
+  assert(returned == small);
+  rb_arena_destroy(&arena);
+  // sizes that overflow are refused, huge page ranges are 2MB aligned
+  if (rb_arena_init(&arena, sizeof(t_container), SIZE_MAX / 16, true)) {
+    std::cout << "arena count overflow: fail\n";
+    rb_arena_destroy(&arena);
+  }
+  if (rb_arena_init(&arena, SIZE_MAX, 1, false)) {
+    std::cout << "arena slot size overflow: fail\n";
+    rb_arena_destroy(&arena);
+  }
+  if (rb_arena_init(&arena, sizeof(t_container), small, true)) {
+    assert(reinterpret_cast<uintptr_t>(arena.base) % (2 << 20) == 0 && arena.size == (2 << 20));
+    rb_arena_destroy(&arena);
+  }
+
+  std::vector<int> sizes = quick ? std::vector<int>{1 << 12} : std::vector<int>{1 << 20, 1 << 23};
+  for (int size : sizes) {
+    std::minstd_rand rng(size);
+    keys.resize(size);
+    for (auto& key : keys) {
+      key = rng();
+    }
+    node_timing heap = time_nodes(keys, NULL);
+    if (!rb_arena_init(&arena, sizeof(t_container), size, true)) {
+      std::cout << "arena: mmap failed\n";
+      return;
+    }
+    node_timing slab = time_nodes(keys, &arena);
+    std::cout << "arena: " << size << " nodes\n";
+    print_ratio("insert", slab.insert, heap.insert, "malloc");
+    print_ratio("find", slab.find, heap.find, "malloc");
+    print_ratio("iterate", slab.iterate, heap.iterate, "malloc");
+    print_ratio("teardown", slab.teardown, heap.teardown, "malloc");
+  }
+  std::cout << '\n';
+}
+
+// black height of an index subtree, -1 if broken, as black_height does for pointers
+static int  black_height32(const t_rbtree32* tree, uint32_t idx)
+{
+  if (idx == 0) {
+    return 0;
+  }
+  const t_rbnode32* n = &tree->nodes[idx];
+  int left = black_height32(tree, n->left);
+  int right = black_height32(tree, n->right);
+  bool red = n->pc & 1;
+  bool broken_link = (n->left != 0 && tree->nodes[n->left].pc >> 1 != idx)
+                     || (n->right != 0 && tree->nodes[n->right].pc >> 1 != idx);
+
+  if (left < 0 || left != right || broken_link
+      || (red && ((tree->nodes[n->left].pc & 1) || (tree->nodes[n->right].pc & 1)))) {
+    return -1;
+  }
+  return left + !red;
+}
+
+static bool is_valid_tree32(const t_rbtree32* tree, const std::vector<int64_t>& sorted)
+{
+  std::vector<int64_t> keys;
+
+  for (uint32_t idx = rb32_first(tree); idx != 0; idx = rb32_next(tree, idx)) {
+    keys.push_back(tree->keys[idx]);
+  }
+  return (tree->root == 0 || ((tree->nodes[tree->root].pc & 1) == 0 && black_height32(tree, tree->root) >= 0))
+         && tree->nodes[0].pc == 0 && tree->nodes[0].left == 0 && tree->nodes[0].right == 0 && keys == sorted;
+}
+
+// 32-bit index nodes against pointer nodes: memory per element and lookups.
+void bench_index_tree(bool quick)
+{
+  int size = quick ? 1 << 12 : 1 << 22;
+  std::minstd_rand rng(size);
+  // position 0 is the nil node
+  std::vector<t_rbnode32> nodes(size + 1);
+  std::vector<int64_t> keys(size + 1);
+  std::vector<int64_t> sorted;
+  std::vector<t_entity> entities(size);
+  t_rbtree32 tree;
+  t_rbtree ptree = rb_create_tree();
+
+  rb32_init(&tree, nodes.data(), keys.data());
+  for (int i = 1; i <= size; ++i) {
+    keys[i] = static_cast<int64_t>(rng()) << 16 | (rng() & 0xffff);
+    rb32_insert(&tree, i);
+    entities[i - 1].vruntime = keys[i];
+    entity_tree_insert(&ptree, &entities[i - 1]);
+  }
+  sorted.assign(keys.begin() + 1, keys.end());
+  std::sort(sorted.begin(), sorted.end());
+  if (!is_valid_tree32(&tree, sorted)) {
+    std::cout << "index tree insert: fail\n";
+    return;
+  }
+  // erase the odd positions, then move the array
+  sorted.clear();
+  for (int i = 1; i <= size; ++i) {
+    if (i % 2) {
+      rb32_erase(&tree, i);
+    } else {
+      sorted.push_back(keys[i]);
+    }
+  }
+  std::sort(sorted.begin(), sorted.end());
+  std::vector<t_rbnode32> moved(nodes);
+  nodes.assign(nodes.size(), t_rbnode32{~0u, {{~0u, ~0u}}});
+  tree.nodes = moved.data();
+  if (!is_valid_tree32(&tree, sorted) || rb32_find(&tree, keys[1]) != 0 || rb32_find(&tree, keys[2]) != 2) {
+    std::cout << "index tree erase: fail\n";
+    return;
+  }
+  for (int i = 1; i <= size; i += 2) {
+    rb32_insert(&tree, i);
+  }
+
+  std::cout << "index tree: " << size << " nodes\n";
+  std::cout << "bytes per element: index = " << sizeof(t_rbnode32) + sizeof(int64_t)
+            << ", pointer = " << sizeof(t_entity) << '\n';
+  std::vector<int64_t> lookups(size);
+  for (auto& key : lookups) {
+    key = keys[1 + rng() % size];
+  }
+  long found = 0;
+  double index_time = measure([&] {
+    for (int64_t key : lookups) found += rb32_find(&tree, key) != 0;
+  });
+  double pointer_time = measure([&] {
+    for (int64_t key : lookups) found += entity_tree_find(&ptree, key) != NULL;
+  });
+  assert(found == 2L * size);
+  print_ratio("find", index_time, pointer_time, "pointer nodes");
+  std::cout << '\n';
+}
+
+typedef struct container_td {
+  t_rbnode_td node;
+  int         key;
+  int         val;
+} t_container_td;
+
+static t_rbnode_td* td_left(const t_rbnode_td* node)
+{
+  return reinterpret_cast<t_rbnode_td*>(node->lc & ~static_cast<uintptr_t>(1));
+}
+
+static bool td_is_red(const t_rbnode_td* node)
+{
+  return node != NULL && (node->lc & 1) == RED;
+}
+
+bool  td_less(t_rbnode_td* n1, const t_rbnode_td* n2)
+{
+  return container_of(n1, t_container_td, node)->key < container_of(n2, t_container_td, node)->key;
+}
+
+int   td_compare(const void* key, const t_rbnode_td* node)
+{
+  return reinterpret_cast<long int>(key) - container_of(node, t_container_td, node)->key;
+}
+
+// black height of a top-down subtree, -1 if broken
+static int  td_black_height(const t_rbnode_td* node)
+{
+  if (node == NULL) {
+    return 0;
+  }
+  int left = td_black_height(td_left(node));
+  int right = td_black_height(node->right);
+  bool red = td_is_red(node);
+
+  if (left < 0 || left != right || (red && (td_is_red(td_left(node)) || td_is_red(node->right)))) {
+    return -1;
+  }
+  return left + !red;
+}
+
+static bool is_valid_tree_td(const t_rbtree_td* tree, const std::vector<int>& sorted)
+{
+  t_rbiter_td       iter;
+  std::vector<int>  keys;
+
+  for (t_rbnode_td* node = rb_td_first(tree, &iter); node != NULL; node = rb_td_next(&iter)) {
+    keys.push_back(container_of(node, t_container_td, node)->key);
+  }
+  return !td_is_red(tree->root) && td_black_height(tree->root) >= 0 && keys == sorted;
+}
+
+// top-down parent-free tree against the bottom-up one: insert, find, erase by key.
+void bench_topdown(bool quick)
+{
+  int size = quick ? 1 << 12 : 1 << 21;
+  std::minstd_rand rng(size);
+  std::vector<int> keys(size);
+  std::vector<int> sorted;
+  std::vector<t_container_td> nodes(size);
+  std::vector<t_container> containers(size);
+  t_rbtree_td tree = {NULL};
+  t_rbtree ptree = rb_create_tree();
+
+  // duplicates on purpose
+  for (int i = 0; i < size; ++i) {
+    keys[i] = rng() % (size / 2);
+    nodes[i].key = containers[i].key = keys[i];
+  }
+  sorted = keys;
+  std::sort(sorted.begin(), sorted.end());
+  for (int i = 0; i < size; ++i) {
+    rb_td_insert(&tree, &nodes[i].node, td_less);
+  }
+  if (!is_valid_tree_td(&tree, sorted)) {
+    std::cout << "top-down insert: fail\n";
+    return;
+  }
+  // erase every other key, then a key that is not there
+  for (int i = 0; i < size; i += 2) {
+    t_rbnode_td* node = rb_td_erase(&tree, reinterpret_cast<void*>(static_cast<long int>(keys[i])), td_compare);
+    if (node == NULL || container_of(node, t_container_td, node)->key != keys[i]) {
+      std::cout << "top-down erase: fail\n";
+      return;
+    }
+    if (quick) {
+      sorted.erase(std::lower_bound(sorted.begin(), sorted.end(), keys[i]));
+      if (!is_valid_tree_td(&tree, sorted)) {
+        std::cout << "top-down erase: fail\n";
+        return;
+      }
+    }
+  }
+  sorted.clear();
+  for (int i = 1; i < size; i += 2) {
+    sorted.push_back(keys[i]);
+  }
+  std::sort(sorted.begin(), sorted.end());
+  if (!is_valid_tree_td(&tree, sorted)
+      || rb_td_erase(&tree, reinterpret_cast<void*>(static_cast<long int>(size)), td_compare) != NULL
+      || rb_td_find(reinterpret_cast<void*>(static_cast<long int>(size)), &tree, td_compare) != NULL) {
+    std::cout << "top-down erase: fail\n";
+    return;
+  }
+  while (tree.root != NULL) {
+    rb_td_erase(&tree, reinterpret_cast<void*>(static_cast<long int>(container_of(tree.root, t_container_td, node)->key)),
+                td_compare);
+  }
+
+  std::cout << "top-down tree: " << size << " nodes\n";
+  std::cout << "bytes per node: top-down = " << sizeof(t_rbnode_td) << ", bottom-up = " << sizeof(t_rbnode) << '\n';
+  double td_insert = measure([&] {
+    for (auto& n : nodes) rb_td_insert(&tree, &n.node, td_less);
+  });
+  double bu_insert = measure([&] {
+    for (auto& c : containers) rb_insert(&ptree, &c.node, rb_less);
+  });
+  long found = 0;
+  double td_find = measure([&] {
+    for (int key : keys) found += rb_td_find(reinterpret_cast<void*>(static_cast<long int>(key)), &tree, td_compare) != NULL;
+  });
+  double bu_find = measure([&] {
+    for (int key : keys) found += rb_find(reinterpret_cast<void*>(static_cast<long int>(key)), &ptree, rb_compare) != rb_nil;
+  });
+  assert(found == 2L * size);
+  double td_erase = measure([&] {
+    for (int key : keys) rb_td_erase(&tree, reinterpret_cast<void*>(static_cast<long int>(key)), td_compare);
+  });
+  double bu_erase = measure([&] {
+    for (int key : keys) rb_erase(&ptree, rb_find(reinterpret_cast<void*>(static_cast<long int>(key)), &ptree, rb_compare));
+  });
+  assert(tree.root == NULL && ptree.root == rb_nil);
+  print_ratio("insert", td_insert, bu_insert, "bottom-up");
+  print_ratio("find", td_find, bu_find, "bottom-up");
+  print_ratio("erase by key", td_erase, bu_erase, "find + bottom-up erase");
+  std::cout << '\n';
+}
+
+// lookups and inserts in lockstep against one descent at a time, on a tree larger than the cache.
+void bench_find_batch(bool quick)
+{
+  int size = quick ? 1 << 12 : 1 << 22;
+  int batch = 64;
+  std::minstd_rand rng(size);
+  std::vector<t_container> plain_nodes(size);
+  std::vector<t_container> batch_nodes(size);
+  std::vector<t_rbnode*> links(size);
+  std::vector<const void*> keys(size);
+  std::vector<t_rbnode*> expected(size);
+  std::vector<t_rbnode*> out(size);
+  t_rbtree plain = rb_create_tree();
+  t_rbtree batched = rb_create_tree();
+
+  for (int i = 0; i < size; ++i) {
+    plain_nodes[i].key = batch_nodes[i].key = rng() % size;
+    plain_nodes[i].val = batch_nodes[i].val = i;
+    links[i] = &batch_nodes[i].node;
+  }
+  std::cout << "batched lookups: " << size << " nodes, batches of " << batch << '\n';
+  double insert_time = measure([&] {
+    for (auto& c : plain_nodes) rb_insert(&plain, &c.node, rb_less);
+  });
+  double batch_insert_time = measure([&] {
+    for (int i = 0; i < size; i += batch) rb_insert_batch(&batched, &links[i], std::min(batch, size - i), rb_less);
+  });
+  // same shape and the same order of equal keys
+  for (t_rbnode *a = rb_first(&plain), *b = rb_first(&batched); a != NULL || b != NULL; a = rb_next(a), b = rb_next(b)) {
+    if (a == NULL || b == NULL || container_of(a, t_container, node)->val != container_of(b, t_container, node)->val) {
+      std::cout << "insert batch: fail\n";
+      return;
     }
+  }
+  if (!is_valid_tree(&batched)) {
+    std::cout << "insert batch: fail\n";
+    return;
+  }
 
-    /*
-    if (check_equal(rbtree, map) == false) {
-      std::cout << i << "th erase, key = " << key << ": check_erase fail\n";
+  // about a third of the keys are missing
+  for (auto& key : keys) {
+    key = reinterpret_cast<void*>(static_cast<long int>(rng() % size));
+  }
+  double find_time = measure([&] {
+    for (int i = 0; i < size; ++i) expected[i] = rb_find(keys[i], &plain, rb_compare);
+  });
+  double batch_find_time = measure([&] {
+    for (int i = 0; i < size; i += batch) rb_find_batch(&keys[i], std::min(batch, size - i), &plain, rb_compare, &out[i]);
+  });
+  for (int i = 0; i < size; ++i) {
+    if ((out[i] == NULL) != (expected[i] == NULL)
+        || (out[i] != NULL && rb_compare(keys[i], out[i]) != 0)) {
+      std::cout << "find batch: fail\n";
       return;
     }
-    */
   }
-  //std::cout << "erase success\n";
+  print_ratio("insert", batch_insert_time, insert_time, "one by one");
+  print_ratio("find", batch_find_time, find_time, "one by one");
+  std::cout << '\n';
 }
 
-void deallocate(t_rbtree* tree)
+static int64_t container_key(const t_rbnode* node)
 {
-  t_rbnode* node = rb_first(tree);
+  return container_of(node, t_container, node)->key;
+}
 
-  while (node != NULL) {
-    t_container* temp = container_of(node, t_container, node);
+// the snapshot against the live tree, lower_bound and a short scan for each key.
+static bool check_snapshot(t_rbtree* tree, const t_rbsnapshot* snap, const std::vector<long int>& keys)
+{
+  for (long int key : keys) {
+    t_rbnode* node = rb_lower_bound(reinterpret_cast<void*>(key), tree, rb_compare);
+    size_t pos = rb_snapshot_lower_bound(snap, key);
 
-    // it must be post-order
-    node = rb_next(node);
-    free(temp);
+    for (int step = 0; step < 4; ++step) {
+      if ((node == NULL) != (pos == 0) || (node != NULL && snap->nodes[pos] != node)) {
+        return false;
+      }
+      if (node == NULL) {
+        break;
+      }
+      node = rb_next(node);
+      pos = rb_snapshot_next(snap, pos);
+    }
+  }
+  return true;
+}
+
+// lookups on a frozen Eytzinger copy against the pointer tree.
+void bench_snapshot(bool quick)
+{
+  int size = quick ? 1 << 12 : 1 << 22;
+  std::minstd_rand rng(size);
+  std::vector<t_container> containers(size);
+  std::vector<long int> keys(size);
+  t_rbtree tree = rb_create_tree();
+  t_rbsnapshot snap = rb_create_snapshot();
+
+  for (auto& c : containers) {
+    c.key = rng() % size;
+    rb_insert(&tree, &c.node, rb_less);
+  }
+  // keys below and above every node too
+  for (auto& key : keys) {
+    key = static_cast<long int>(rng() % (size + 2)) - 1;
+  }
+  double freeze_time = measure([&] {
+    if (!rb_freeze(&tree, container_key, &snap)) {
+      std::cout << "snapshot: out of memory\n";
+    }
+  });
+  if (snap.size != static_cast<size_t>(size) || !check_snapshot(&tree, &snap, keys)) {
+    std::cout << "snapshot: fail\n";
+    return;
+  }
+  // the live tree takes writes, then the snapshot is refreshed in place
+  for (int i = 0; i < size; i += 2) {
+    rb_erase(&tree, &containers[i].node);
+  }
+  for (int i = 0; i < size; i += 4) {
+    containers[i].key = rng() % size;
+    rb_insert(&tree, &containers[i].node, rb_less);
+  }
+  int64_t* keys_buffer = snap.keys;
+  if (!rb_freeze(&tree, container_key, &snap) || snap.keys != keys_buffer || !check_snapshot(&tree, &snap, keys)) {
+    std::cout << "snapshot refresh: fail\n";
+    return;
+  }
+
+  std::cout << "snapshot: " << snap.size << " nodes\n";
+  long tree_found = 0;
+  long snap_found = 0;
+  double tree_time = measure([&] {
+    for (long int key : keys) tree_found += rb_lower_bound(reinterpret_cast<void*>(key), &tree, rb_compare) != NULL;
+  });
+  double snap_time = measure([&] {
+    for (long int key : keys) snap_found += rb_snapshot_lower_bound(&snap, key) != 0;
+  });
+  assert(tree_found == snap_found);
+  std::cout << "freeze: " << freeze_time << '\n';
+  print_ratio("lower_bound", tree_time, snap_time, "snapshot");
+  rb_snapshot_destroy(&snap);
+  std::cout << '\n';
+}
+
+struct seq_bench
+{
+  bool                      locked;   // readers and writer take the mutex, with the plain functions
+  t_rbtree_seq              tree;
+  std::mutex                lock;
+  std::vector<t_container>  stable;   // even keys, never erased
+  std::vector<t_container>  churn;    // odd keys, erased and inserted again
+  std::vector<bool>         linked;
+  std::atomic<bool>         stop;
+  std::atomic<bool>         failed;
+  std::atomic<long>         lookups;
+  long                      writes;
+};
+
+// a steady stream of erases and inserts, pausing every 16 changes.
+static void seq_writer(seq_bench* b)
+{
+  std::minstd_rand rng(7);
+
+  b->writes = 0;
+  while (!b->stop.load(std::memory_order_relaxed)) {
+    size_t i = rng() % b->churn.size();
+    t_rbnode* node = &b->churn[i].node;
+
+    if (b->locked) {
+      std::lock_guard<std::mutex> guard(b->lock);
+      b->linked[i] ? rb_erase(&b->tree.rbtree, node) : rb_insert(&b->tree.rbtree, node, rb_less);
+    } else {
+      b->linked[i] ? rb_seq_erase(&b->tree, node) : rb_seq_insert(&b->tree, node, rb_less);
+    }
+    b->linked[i] = !b->linked[i];
+    if (++b->writes % 16 == 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+}
+
+// stable keys must always be found, whatever the writer is doing.
+static void seq_reader(seq_bench* b, unsigned seed)
+{
+  std::minstd_rand rng(seed);
+  long count = 0;
+
+  while (!b->stop.load(std::memory_order_relaxed)) {
+    long int key = 2 * (rng() % b->stable.size());
+    t_rbnode* node;
+
+    if (b->locked) {
+      std::lock_guard<std::mutex> guard(b->lock);
+      node = rb_find(reinterpret_cast<void*>(key), &b->tree.rbtree, rb_compare);
+    } else {
+      node = rb_seq_find(reinterpret_cast<void*>(key), &b->tree, rb_compare);
+    }
+    if (node == NULL || container_of(node, t_container, node)->key != key) {
+      b->failed = true;
+    }
+    ++count;
+  }
+  b->lookups += count;
+}
+
+static void seq_setup(seq_bench* b, bool locked, int size)
+{
+  b->locked = locked;
+  b->tree = rb_create_tree_seq();
+  b->stable.resize(size);
+  b->churn.resize(size / 4);
+  b->linked.assign(size / 4, false);
+  b->failed = false;
+  for (int i = 0; i < size; ++i) {
+    b->stable[i].key = 2 * i;
+    rb_seq_insert(&b->tree, &b->stable[i].node, rb_less);
+  }
+  for (size_t i = 0; i < b->churn.size(); ++i) {
+    b->churn[i].key = 2 * (i * 4) + 1;
+  }
+}
+
+// lookups per second of @threads readers while the writer runs.
+static double seq_run(seq_bench* b, int threads, int millis)
+{
+  std::vector<std::thread> readers;
+
+  b->stop = false;
+  b->lookups = 0;
+  std::thread writer(seq_writer, b);
+  for (int t = 0; t < threads; ++t) {
+    readers.emplace_back(seq_reader, b, t + 1);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+  b->stop = true;
+  writer.join();
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  return b->lookups / (millis / 1000.0);
+}
+
+// in order through the lockless iterator, once the writer is gone.
+static bool check_seq_tree(seq_bench* b)
+{
+  size_t count = 0;
+  int last = -1;
+
+  for (t_rbnode* node = rb_seq_first(&b->tree); node != NULL; node = rb_seq_next(&b->tree, node), ++count) {
+    int key = container_of(node, t_container, node)->key;
+    if (key <= last) {
+      return false;
+    }
+    last = key;
+  }
+  return !b->failed && is_valid_tree(&b->tree.rbtree)
+         && count == b->stable.size() + std::count(b->linked.begin(), b->linked.end(), true);
+}
+
+// lockless seqcount readers against readers taking the writer's mutex, one writer changing the tree meanwhile.
+void bench_seq_readers(bool quick)
+{
+  int size = quick ? 1 << 10 : 1 << 16;
+  int max_threads = quick ? 2 : 64;
+  int millis = quick ? 10 : 200;
+  seq_bench lockless;
+  seq_bench locked;
+
+  seq_setup(&lockless, false, size);
+  seq_setup(&locked, true, size);
+  std::cout << "seqcount readers: " << size << " nodes, one writer\n";
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    double lockless_rate = seq_run(&lockless, threads, millis);
+    double locked_rate = seq_run(&locked, threads, millis);
+
+    std::cout << "threads = " << threads << ", lookups/s: seqcount = " << lockless_rate << ", mutex = " << locked_rate;
+    std::cout << ", ratio = " << lockless_rate / locked_rate;
+    std::cout << ", writes: " << lockless.writes << " / " << locked.writes << '\n';
+  }
+  if (!check_seq_tree(&lockless) || !check_seq_tree(&locked)) {
+    std::cout << "seqcount readers: fail\n";
+  }
+  std::cout << '\n';
+}
+
+int   p_compare(const void* key, const void* item)
+{
+  long int a = reinterpret_cast<long int>(key);
+  long int b = reinterpret_cast<long int>(item);
+
+  return (a > b) - (a < b);
+}
+
+// black height of a persistent subtree, -1 if broken
+static int  p_black_height(const t_rbpnode* node)
+{
+  if (node == NULL) {
+    return 0;
+  }
+  int left = p_black_height(node->child[0]);
+  int right = p_black_height(node->child[1]);
+  bool red = node->color == RED;
+
+  if (left < 0 || left != right || node->refs == 0
+      || (red && ((node->child[0] && node->child[0]->color == RED) || (node->child[1] && node->child[1]->color == RED)))) {
+    return -1;
+  }
+  return left + !red;
+}
+
+// a compare that releases a snapshot partway through a descent, as a reader
+// finishing its scan on another thread would.
+static t_rbptree* released_mid_erase;
+static int mid_erase_calls;
+
+static int p_compare_releasing(const void* key, const void* item)
+{
+  if (++mid_erase_calls == 2 && released_mid_erase != NULL) {
+    rb_p_release(released_mid_erase);
+    released_mid_erase = NULL;
+  }
+  return p_compare(key, item);
+}
+
+static bool is_valid_version(const t_rbptree* tree, const std::vector<long int>& sorted)
+{
+  t_rbpiter iter;
+  std::vector<long int> items;
+
+  for (void* item = rb_p_first(tree, &iter); item != NULL; item = rb_p_next(&iter)) {
+    items.push_back(reinterpret_cast<long int>(item));
+  }
+  return (tree->root == NULL || tree->root->color == BLACK) && p_black_height(tree->root) >= 0
+         && tree->size == sorted.size() && items == sorted;
+}
+
+// runs @size inserts, then erases every key, on a persistent version, keeping a snapshot every @every updates.
+static double p_updates(const std::vector<long int>& keys, int every)
+{
+  t_rbptree tree = rb_create_tree_p();
+  t_rbptree snap = rb_create_tree_p();
+  int updates = 0;
+
+  return measure([&] {
+    for (long int key : keys) {
+      rb_p_insert(&tree, reinterpret_cast<void*>(key), p_compare);
+      if (every && ++updates % every == 0) {
+        rb_p_release(&snap);
+        snap = rb_p_snapshot(&tree);
+      }
+    }
+    for (long int key : keys) {
+      rb_p_erase(&tree, reinterpret_cast<void*>(key), p_compare);
+      if (every && ++updates % every == 0) {
+        rb_p_release(&snap);
+        snap = rb_p_snapshot(&tree);
+      }
+    }
+    rb_p_release(&snap);
+    assert(tree.root == NULL);
+  });
+}
+
+// path copying: old versions stay intact while the live one changes, and what an update costs.
+void bench_persistent(bool quick)
+{
+  int size = quick ? 1 << 11 : 1 << 20;
+  std::minstd_rand rng(size);
+  std::vector<long int> keys(size);
+  std::multiset<long int> model;
+  std::vector<std::pair<t_rbptree, std::vector<long int>>> versions;
+  t_rbptree tree = rb_create_tree_p();
+  bool ok = true;
+
+  // keys start at 1, a NULL item means none
+  for (auto& key : keys) {
+    key = 1 + rng() % size;
+  }
+  for (int i = 0; i < 2 * size; ++i) {
+    long int key = keys[rng() % size];
+
+    if (rng() % 3 == 0) {
+      void* erased = rb_p_erase(&tree, reinterpret_cast<void*>(key), p_compare);
+      auto it = model.find(key);
+      if ((erased == NULL) != (it == model.end()) || (erased != NULL && reinterpret_cast<long int>(erased) != key)) {
+        ok = false;
+      }
+      if (it != model.end()) {
+        model.erase(it);
+      }
+    } else {
+      rb_p_insert(&tree, reinterpret_cast<void*>(key), p_compare);
+      model.insert(key);
+    }
+    if (i % (size / 4) == 0) {
+      versions.emplace_back(rb_p_snapshot(&tree), std::vector<long int>(model.begin(), model.end()));
+    }
+  }
+  // a missing key leaves the version as it is, shared nodes included
+  t_rbpnode* root = tree.root;
+  t_rbptree shared = rb_p_snapshot(&tree);
+  ok = ok && rb_p_erase(&tree, reinterpret_cast<void*>(size + 1), p_compare) == NULL && tree.root == root;
+  rb_p_release(&shared);
+  ok = ok && rb_p_erase(&tree, reinterpret_cast<void*>(size + 1), p_compare) == NULL && tree.root == root;
+  // the only snapshot sharing the path goes away while the erase is under way
+  for (long int erased = 1; erased <= 64; ++erased) {
+    t_rbptree local = rb_create_tree_p();
+    std::vector<long int> rest;
+
+    for (long int key = 1; key <= 64; ++key) {
+      rb_p_insert(&local, reinterpret_cast<void*>(key), p_compare);
+      if (key != erased) {
+        rest.push_back(key);
+      }
+    }
+    t_rbptree snap = rb_p_snapshot(&local);
+    released_mid_erase = &snap;
+    mid_erase_calls = 0;
+    void* item = rb_p_erase(&local, reinterpret_cast<void*>(erased), p_compare_releasing);
+    ok = ok && reinterpret_cast<long int>(item) == erased && is_valid_version(&local, rest);
+    if (released_mid_erase != NULL) {
+      rb_p_release(released_mid_erase);
+      released_mid_erase = NULL;
+    }
+    rb_p_release(&local);
+  }
+  // a writer thread frees its spare nodes when it exits
+  std::thread([&] {
+    t_rbptree local = rb_create_tree_p();
+    for (long int key = 1; key <= 256; ++key) {
+      rb_p_insert(&local, reinterpret_cast<void*>(key), p_compare);
+    }
+    for (long int key = 1; key <= 256; key += 2) {
+      ok = ok && rb_p_erase(&local, reinterpret_cast<void*>(key), p_compare) != NULL;
+    }
+    rb_p_release(&local);
+  }).join();
+  // every snapshot still reads as it was taken
+  ok = ok && is_valid_version(&tree, std::vector<long int>(model.begin(), model.end()));
+  for (auto& version : versions) {
+    ok = ok && is_valid_version(&version.first, version.second);
+    rb_p_release(&version.first);
+  }
+  rb_p_release(&tree);
+  if (!ok) {
+    std::cout << "persistent tree: fail\n";
+    return;
+  }
+
+  std::cout << "persistent tree: " << size << " inserts, then as many erases\n";
+  std::vector<t_container> containers(size);
+  t_rbtree inplace = rb_create_tree();
+  double inplace_time = measure([&] {
+    for (int i = 0; i < size; ++i) {
+      containers[i].key = keys[i];
+      rb_insert(&inplace, &containers[i].node, rb_less);
+    }
+    for (long int key : keys) {
+      rb_erase(&inplace, rb_find(reinterpret_cast<void*>(key), &inplace, rb_compare));
+    }
+  });
+  print_ratio("no snapshot", p_updates(keys, 0), inplace_time, "in place");
+  print_ratio("snapshot every 16 updates", p_updates(keys, 16), inplace_time, "in place");
+  print_ratio("snapshot every update", p_updates(keys, 1), inplace_time, "in place");
+  std::cout << '\n';
+}
+
+// record saved with each node of an image.
+typedef struct record {
+  int key;
+  int val;
+} t_record;
+
+static void store_record(const t_rbnode* node, void* record)
+{
+  const t_container* c = container_of(node, t_container, node);
+  t_record* r = static_cast<t_record*>(record);
+
+  r->key = c->key;
+  r->val = c->val;
+}
+
+static int record_compare(const void* key, const void* record)
+{
+  int k = *static_cast<const int*>(key);
+  int r = static_cast<const t_record*>(record)->key;
+
+  return (k > r) - (k < r);
+}
+
+// in order, the image holds the records of the tree.
+static bool is_valid_image(const t_rbimage* image, t_rbtree* tree)
+{
+  const void* record = rb_image_first(image);
+  size_t count = 0;
+
+  for (t_rbnode* node = rb_first(tree); node != NULL; node = rb_next(node), ++count) {
+    const t_container* c = container_of(node, t_container, node);
+    const t_record* r = static_cast<const t_record*>(record);
+
+    if (r == NULL || r->key != c->key || r->val != c->val) {
+      return false;
+    }
+    record = rb_image_next(record);
+  }
+  return record == NULL && count == image->count;
+}
+
+// opens copies of the image cut short or with a broken header.
+static bool is_corrupt_image_accepted(const char* path)
+{
+  std::string copy = std::string(path) + ".copy";
+  t_rbimage image;
+  bool accepted = false;
+  int in = open(path, O_RDONLY);
+  off_t length = lseek(in, 0, SEEK_END);
+  std::vector<char> bytes(length);
+
+  accepted |= pread(in, bytes.data(), length, 0) != length;
+  close(in);
+  for (int damage = 0; damage < 3; ++damage) {
+    std::vector<char> broken(bytes);
+    uint64_t huge = UINT64_MAX / 8;
+
+    if (damage == 0) {
+      broken.resize(length - 8);
+    } else if (damage == 1) {
+      memcpy(&broken[8], &huge, sizeof(huge));   // count
+    } else {
+      memcpy(&broken[32], &huge, sizeof(huge));  // root
+    }
+    int out = open(copy.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    accepted |= write(out, broken.data(), broken.size()) != (ssize_t)broken.size();
+    close(out);
+    if (rb_image_open(&image, copy.c_str())) {
+      rb_image_close(&image);
+      accepted = true;
+    }
+  }
+  unlink(copy.c_str());
+  return accepted;
+}
+
+// every key is found in a process that only maps the file.
+static bool image_child_finds(const char* path, const std::vector<int>& keys)
+{
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    t_rbimage image;
+    bool ok = rb_image_open(&image, path);
+
+    for (size_t i = 0; ok && i < keys.size(); ++i) {
+      const t_record* r = static_cast<const t_record*>(rb_image_find(&image, &keys[i], record_compare));
+      ok = r != NULL && r->key == keys[i];
+    }
+    rb_image_close(&image);
+    _exit(ok ? 0 : 1);
+  }
+  int status;
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// startup of a saved tree: mapping its image against reinserting its records.
+void bench_image(bool quick)
+{
+  int size = quick ? 1 << 12 : 1 << 21;
+  int lookups = 1000;
+  std::minstd_rand rng(size);
+  std::vector<t_container> containers(size);
+  std::vector<int> keys(size);
+  t_rbtree tree = rb_create_tree();
+  char image_path[] = "/tmp/rbtree_image_XXXXXX";
+  char flat_path[] = "/tmp/rbtree_flat_XXXXXX";
+  int image_fd = mkstemp(image_path);
+  int flat_fd = mkstemp(flat_path);
+  t_rbimage image = {};
+  bool ok = image_fd >= 0 && flat_fd >= 0;
+
+  for (int i = 0; i < size; ++i) {
+    containers[i].key = keys[i] = rng() % (size * 2);
+    containers[i].val = i;
+    rb_insert(&tree, &containers[i].node, rb_less);
+  }
+  ok = ok && rb_image_save(image_path, &tree, sizeof(t_record), store_record);
+  ok = ok && rb_image_open(&image, image_path);
+  ok = ok && is_valid_image(&image, &tree);
+
+  // the rebuild baseline starts from the same records, unordered
+  std::vector<t_record> flat(size);
+  for (int i = 0; i < size; ++i) {
+    flat[i].key = containers[i].key;
+    flat[i].val = containers[i].val;
+  }
+  ok = ok && write(flat_fd, flat.data(), size * sizeof(t_record)) == (ssize_t)(size * sizeof(t_record));
+
+  std::vector<int> sorted(keys);
+  std::sort(sorted.begin(), sorted.end());
+  for (int i = 0; ok && i < size; ++i) {
+    int key = rng() % (size * 2 + 1);
+    const t_record* found = static_cast<const t_record*>(rb_image_find(&image, &keys[i], record_compare));
+    const t_record* lower = static_cast<const t_record*>(rb_image_lower_bound(&image, &key, record_compare));
+    auto it = std::lower_bound(sorted.begin(), sorted.end(), key);
+
+    ok = found != NULL && found->key == keys[i] && found->val < size && keys[found->val] == keys[i];
+    ok = ok && (lower == NULL ? it == sorted.end() : it != sorted.end() && lower->key == *it);
+  }
+  ok = ok && image_child_finds(image_path, keys);
+  // saving again replaces the file, the old mapping stays readable
+  ok = ok && rb_image_save(image_path, &tree, sizeof(t_record), store_record);
+  ok = ok && is_valid_image(&image, &tree);
+  ok = ok && !is_corrupt_image_accepted(image_path);
+  rb_image_close(&image);
+  close(image_fd);
+  close(flat_fd);
+  if (!ok) {
+    std::cout << "tree image: fail\n";
+    unlink(image_path);
+    unlink(flat_path);
+    return;
+  }
+
+  // first answers after startup, both files in the page cache
+  std::vector<int> probes(lookups);
+  for (auto& probe : probes) {
+    probe = keys[rng() % size];
+  }
+  long found = 0;
+  double mmap_time = measure([&] {
+    t_rbimage mapped;
+
+    rb_image_open(&mapped, image_path);
+    for (int key : probes) {
+      found += rb_image_find(&mapped, &key, record_compare) != NULL;
+    }
+    rb_image_close(&mapped);
+  });
+  double rebuild_time = measure([&] {
+    std::vector<t_record> records(size);
+    std::vector<t_container> nodes(size);
+    t_rbtree rebuilt = rb_create_tree();
+    int fd = open(flat_path, O_RDONLY);
+
+    found += read(fd, records.data(), size * sizeof(t_record)) > 0;
+    close(fd);
+    for (int i = 0; i < size; ++i) {
+      nodes[i].key = records[i].key;
+      nodes[i].val = records[i].val;
+      rb_insert(&rebuilt, &nodes[i].node, rb_less);
+    }
+    for (int key : probes) {
+      found += rb_find(reinterpret_cast<void*>(key), &rebuilt, rb_compare) != NULL;
+    }
+  });
+  assert(found == 2 * lookups + 1);
+
+  std::cout << "tree image: " << size << " nodes, " << lookups << " lookups after startup\n";
+  print_ratio("startup", mmap_time, rebuild_time, "rebuild by insert");
+
+  // steady state, every key once
+  rb_image_open(&image, image_path);
+  double image_time = measure([&] {
+    for (int key : keys) {
+      found += rb_image_find(&image, &key, record_compare) != NULL;
+    }
+  });
+  double tree_time = measure([&] {
+    for (int key : keys) {
+      found += rb_find(reinterpret_cast<void*>(key), &tree, rb_compare) != NULL;
+    }
+  });
+  assert(found == 2 * lookups + 1 + 2L * size);
+  print_ratio("find every key", image_time, tree_time, "pointer tree");
+  rb_image_close(&image);
+  unlink(image_path);
+  unlink(flat_path);
+  std::cout << '\n';
+}
+
+// simulated task, charged a whole tick whenever it is picked.
+typedef struct task {
+  t_rbentity  se;
+  uint64_t    runtime;
+} t_task;
+
+static const uint64_t sched_tick_ns = 4000000;
+
+// keeps simulated CPUs within a few ticks of each other, whatever the host runs.
+struct sched_barrier {
+  std::atomic<int>  waiting;
+  std::atomic<long> phase;
+  int               threads;
+
+  void wait()
+  {
+    long current = phase.load();
+
+    if (waiting.fetch_add(1) + 1 == threads) {
+      waiting.store(0);
+      phase.fetch_add(1);
+    } else {
+      while (phase.load() == current) {
+        std::this_thread::yield();
+      }
+    }
+  }
+};
+
+// one simulated CPU: runs a tick at a time, some tasks sleep for a while.
+static void sched_cpu(t_rbsched* sched, int cpu, long steps, bool balance, sched_barrier* barrier, long* decisions, long* moved)
+{
+  std::minstd_rand          rng(cpu + 1);
+  std::deque<t_rbentity*>   sleeping;
+
+  for (long step = 0; step < steps; ++step) {
+    if (step % 64 == 0) {
+      barrier->wait();
+    }
+    t_rbentity* curr = rb_sched_tick(sched, cpu, sched_tick_ns);
+
+    if (curr != NULL && rng() % 64 == 0) {
+      rb_sched_dequeue(sched, curr);
+      sleeping.push_back(curr);
+      curr = rb_sched_pick_next(sched, cpu);
+    }
+    if (sleeping.size() > 16) {
+      rb_sched_enqueue(sched, cpu, sleeping.front());
+      sleeping.pop_front();
+    }
+    if (curr != NULL) {
+      container_of(curr, t_task, se)->runtime += sched_tick_ns;
+      ++*decisions;
+    }
+    if (balance && cpu == 0 && step % 64 == 0) {
+      *moved += rb_sched_balance(sched);
+    }
+  }
+  for (t_rbentity* se : sleeping) {
+    rb_sched_enqueue(sched, cpu, se);
+  }
+}
+
+// queues hold every task once, with their weights and a valid tree.
+static bool is_valid_sched(t_rbsched* sched, std::vector<t_task>& tasks)
+{
+  size_t running = 0;
+
+  for (int cpu = 0; cpu < sched->cpus; ++cpu) {
+    t_rbrunqueue* rq = &sched->rq[cpu];
+    uint64_t load = rq->curr != NULL ? rq->curr->weight : 0;
+    size_t count = rq->curr != NULL;
+
+    for (t_rbnode* node = rb_first(&rq->tasks.rbtree); node != NULL; node = rb_next(node), ++count) {
+      t_rbentity* se = container_of(node, t_rbentity, node);
+      load += se->weight;
+      if (se->cpu != cpu) {
+        return false;
+      }
+    }
+    if (!is_valid_tree(&rq->tasks.rbtree) || rq->tasks.leftmost_node != rb_first(&rq->tasks.rbtree)
+        || rq->tasks.rightmost_node != rb_last(&rq->tasks.rbtree) || load != rq->load || count != rq->nr_running) {
+      return false;
+    }
+    running += count;
+  }
+  for (auto& task : tasks) {
+    rb_sched_dequeue(sched, &task.se);
+  }
+  for (int cpu = 0; cpu < sched->cpus; ++cpu) {
+    if (sched->rq[cpu].load != 0 || sched->rq[cpu].nr_running != 0 || rb_leftmost(&sched->rq[cpu].tasks) != NULL) {
+      return false;
+    }
+  }
+  return running == tasks.size();
+}
+
+// CFS simulation: most tasks start on CPU 0 and are spread by the balancer.
+// fairness skew is the spread of runtime scaled by weight, over its mean.
+static void sched_run(int size, int cpus, bool balance)
+{
+  static const uint32_t weights[] = {RB_SCHED_NICE_0_LOAD / 2, RB_SCHED_NICE_0_LOAD, RB_SCHED_NICE_0_LOAD * 2};
+  long steps = 16L * size / cpus;
+  std::vector<t_task> tasks(size);
+  std::vector<long> decisions(cpus), moved(cpus);
+  std::vector<std::thread> threads;
+  sched_barrier barrier;
+  t_rbsched sched;
+
+  if (!rb_sched_init(&sched, cpus)) {
+    std::cout << "scheduler: fail\n";
+    return;
+  }
+  for (int i = 0; i < size; ++i) {
+    tasks[i].se = rb_create_entity(weights[i % 3]);
+    tasks[i].runtime = 0;
+    rb_sched_enqueue(&sched, i % 4 ? 0 : i / 4 % cpus, &tasks[i].se);
   }
+  barrier.waiting = 0;
+  barrier.phase = 0;
+  barrier.threads = cpus;
+  auto start = std::chrono::steady_clock::now();
+  for (int cpu = 0; cpu < cpus; ++cpu) {
+    threads.emplace_back(sched_cpu, &sched, cpu, steps, balance, &barrier, &decisions[cpu], &moved[cpu]);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> duration(std::chrono::steady_clock::now() - start);
+
+  double sum = 0, min = 0, max = 0;
+  for (int i = 0; i < size; ++i) {
+    double service = double(tasks[i].runtime) * RB_SCHED_NICE_0_LOAD / tasks[i].se.weight / sched_tick_ns;
+    sum += service;
+    min = i == 0 ? service : std::min(min, service);
+    max = i == 0 ? service : std::max(max, service);
+  }
+  long total = 0;
+  for (int cpu = 0; cpu < cpus; ++cpu) {
+    total += decisions[cpu];
+  }
+  bool ok = is_valid_sched(&sched, tasks);
+  rb_sched_destroy(&sched);
+  if (!ok) {
+    std::cout << "scheduler: fail\n";
+    return;
+  }
+  std::cout << (balance ? "balanced: " : "no balancing: ") << "decisions/s = " << total / duration.count();
+  std::cout << ", migrations = " << moved[0] << ", weighted ticks per task = " << sum / size;
+  std::cout << ", fairness skew = " << (max - min) / (sum / size) << '\n';
+}
+
+void bench_sched(bool quick)
+{
+  int size = quick ? 1 << 12 : 1 << 20;
+  int cpus = quick ? 2 : 4;
+
+  std::cout << "scheduler: " << size << " tasks, " << cpus << " CPUs, " << 16L * size << " ticks\n";
+  sched_run(size, cpus, false);
+  sched_run(size, cpus, true);
+  std::cout << '\n';
+}
+
+// each thread owns one tree, as one run queue per core would.
+static void independent_tree_worker(int size, int rounds, unsigned seed)
+{
+  t_rbtree                  tree = rb_create_tree();
+  std::vector<t_container>  containers(size);
+  std::minstd_rand          rng(seed);
+
+  for (int i = 0; i < size; ++i) {
+    containers[i].key = rng() % (size * 3);
+    containers[i].val = i;
+  }
+  for (int round = 0; round < rounds; ++round) {
+    for (int i = 0; i < size; ++i) {
+      rb_insert(&tree, &containers[i].node, rb_less);
+    }
+    for (int i = 0; i < size; ++i) {
+      rb_erase(&tree, &containers[i].node);
+    }
+  }
+}
+
+// throughput of N threads working on N independent trees.
+// trees share only the read-only sentinel, so scaling should stay linear up to the core count.
+void bench_independent_trees(bool quick)
+{
+  int size = quick ? 1024 : 1 << 16;
+  int rounds = quick ? 2 : 32;
+  int max_threads = quick ? 2 : std::max(1u, std::thread::hardware_concurrency());
+  double base_throughput = 0;
+
+  std::cout << "independent trees: " << size << " nodes, " << rounds << " rounds per thread\n";
+  for (int threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+    std::vector<std::thread> workers;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t) {
+      workers.emplace_back(independent_tree_worker, size, rounds, t + 1);
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double> duration(end - start);
+
+    double throughput = 2.0 * size * rounds * threads / duration.count();
+    if (threads == 1) {
+      base_throughput = throughput;
+    }
+    std::cout << "threads = " << threads << ", time = " << duration.count();
+    std::cout << ", Mops/s = " << throughput / 1e6;
+    std::cout << ", scaling = " << throughput / base_throughput << '\n';
+    if (threads == max_threads) {
+      break;
+    }
+  }
+  std::cout << '\n';
 }
 
 int main(int argc, char **argv)
@@ -124,7 +2775,8 @@ int main(int argc, char **argv)
 
   // number of loops to get average time consumption.
   int repeat_count = 1;
-  if (argc > 1) {
+  bool quick = argc > 1;
+  if (quick) {
     test_count  = 1;
     max_size = 16;
     repeat_count = 1;
@@ -182,11 +2834,11 @@ int main(int argc, char **argv)
         map_insert_time += i_duration.count();
       }
 
-      if (compare_flag && check_equal(&rbtree.rbtree, map) == false) {
+      if (compare_flag && (check_equal(&rbtree.rbtree, map) == false || check_cached(&rbtree, map, true) == false)) {
         std::cout << "case " << test_idx << ": fail\n";
         break;
       }
-      check_erase(idx_arr, &rbtree.rbtree, map);
+      check_erase(idx_arr, &rbtree, map);
       /*
       std::cout << "insert time = " << i_duration.count() << '\n';
       auto start_erase = std::chrono::steady_clock::now();
@@ -205,6 +2857,36 @@ int main(int argc, char **argv)
     std::cout << '\n';
     max_size *= 2;
   }
+
+  if (check_multimap(quick) == false) {
+    std::cout << "multimap: fail\n";
+  }
+  if (check_join_split(quick) == false) {
+    std::cout << "join/split: fail\n";
+  }
+  bench_independent_trees(quick);
+  bench_template_map(quick);
+  bench_generated_tree(quick);
+  bench_pick_next(quick);
+  bench_sorted_insert(quick);
+  bench_insert_unique(quick);
+  bench_build_sorted(quick);
+  bench_union(quick);
+  bench_augmented(quick);
+  bench_order_statistics(quick);
+  bench_interval_tree(quick);
+  bench_destroy(quick);
+  bench_erase_range(quick);
+  bench_arena(quick);
+  bench_index_tree(quick);
+  bench_topdown(quick);
+  bench_branch_misses(quick);
+  bench_find_batch(quick);
+  bench_snapshot(quick);
+  bench_seq_readers(quick);
+  bench_persistent(quick);
+  bench_image(quick);
+  bench_sched(quick);
 }
 
 void deallocate(t_rbnode* node)
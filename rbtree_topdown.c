@@ -0,0 +1,287 @@
+/*
+ * rbtree_topdown.c
+ *
+ * Red-black tree without parent links: 16 byte nodes holding two children,
+ * the color packed in the low bit of the left one.
+ * Insert and erase rebalance on the way down in a single pass, so no path
+ * has to be walked back up. NULL is the nil node.
+ *
+ * reference
+ * Guibas, Sedgewick. A dichromatic framework for balanced trees. FOCS 1978.
+ * Julienne Walker. Red Black Trees, top-down insertion and deletion.
+ */
+#include "rbtree.h"
+#include "rbtree_tools.h"
+
+static inline t_rbnode_td*
+get_link(const t_rbnode_td* node, bool dir)
+{
+  return dir ? node->right : (t_rbnode_td*)(node->lc & ~(uintptr_t)1);
+}
+
+static inline void
+set_link(t_rbnode_td* node, bool dir, t_rbnode_td* child)
+{
+  if (dir)
+    node->right = child;
+  else
+    node->lc = (uintptr_t)child | (node->lc & 1);
+}
+
+static inline bool
+is_red(const t_rbnode_td* node)
+{
+  return node != NULL && (node->lc & 1) == RED;
+}
+
+static inline void
+set_red(t_rbnode_td* node, bool red)
+{
+  node->lc = (node->lc & ~(uintptr_t)1) | red;
+}
+
+/*
+ *     root           save
+ *     /  \           /  \
+ *   save  c   =>    a   root
+ *   /  \                /  \
+ *  a    b              b    c
+ * rotation toward @dir, the old root becomes red and the new one black.
+ */
+static inline t_rbnode_td*
+rotate_single(t_rbnode_td* root, bool dir)
+{
+  t_rbnode_td* save = get_link(root, !dir);
+
+  set_link(root, !dir, get_link(save, dir));
+  set_link(save, dir, root);
+  set_red(root, true);
+  set_red(save, false);
+  return save;
+}
+
+static inline t_rbnode_td*
+rotate_double(t_rbnode_td* root, bool dir)
+{
+  set_link(root, !dir, rotate_single(get_link(root, !dir), !dir));
+  return rotate_single(root, dir);
+}
+
+/*
+ * @tree: tree to insert in
+ * @node: new node
+ * @less: user provided boolean function, equal keys go after existing ones
+ *
+ * red siblings are split by a color flip on the way down, and the red
+ * violation this may cause with the parent is fixed by a rotation at the
+ * grandparent, so the new red leaf always ends up under a black node.
+ */
+void
+rb_td_insert(t_rbtree_td* tree, t_rbnode_td* node, t_less_td less)
+{
+  t_rbnode_td   head = {0, tree->root};
+  t_rbnode_td*  t = &head;   // great grandparent
+  t_rbnode_td*  g = NULL;    // grandparent
+  t_rbnode_td*  p = NULL;    // parent
+  t_rbnode_td*  q = tree->root;
+  bool          dir = true;
+  bool          last = true;
+
+  node->lc = RED;
+  node->right = NULL;
+  if (q == NULL) {
+    set_red(node, false);
+    tree->root = node;
+    return;
+  }
+
+  while (true) {
+    if (q == NULL) {
+      // p is not NULL, the tree is not empty
+      q = node;
+      set_link(p, dir, q);
+    } else if (is_red(get_link(q, false)) && is_red(q->right)) {
+      set_red(q, true);
+      set_red(get_link(q, false), false);
+      set_red(q->right, false);
+    }
+
+    // two reds in a row: the grandparent is black, rotate it
+    if (is_red(q) && is_red(p)) {
+      bool dir2 = t->right == g;
+
+      if (q == get_link(p, last))
+        set_link(t, dir2, rotate_single(g, !last));
+      else
+        set_link(t, dir2, rotate_double(g, !last));
+    }
+
+    if (q == node)
+      break;
+
+    last = dir;
+    dir = !less(node, q);
+    if (g != NULL)
+      t = g;
+    g = p;
+    p = q;
+    q = get_link(q, dir);
+  }
+  tree->root = head.right;
+  set_red(tree->root, false);
+}
+
+/*
+ * @tree: tree to erase from
+ * @key: key for @cmp
+ * @cmp: user provided compare function
+ *
+ * a red node is pushed down along the search path so that the node finally
+ * unlinked, the in-order predecessor of the match or the match itself, is red
+ * or has a red child. the match is then replaced by that node.
+ * returns the erased node, NULL if no node compares equal.
+ */
+t_rbnode_td*
+rb_td_erase(t_rbtree_td* tree, const void* key, t_compare_td cmp)
+{
+  t_rbnode_td   head = {0, tree->root};
+  t_rbnode_td*  q = &head;
+  t_rbnode_td*  p = NULL;
+  t_rbnode_td*  g = NULL;
+  t_rbnode_td*  found = NULL;
+  t_rbnode_td*  found_parent = NULL;
+  bool          dir = true;
+  bool          last;
+
+  if (tree->root == NULL)
+    return NULL;
+
+  while (get_link(q, dir) != NULL) {
+    last = dir;
+    g = p;
+    p = q;
+    q = get_link(q, dir);
+    if (found != NULL) {
+      // looking for the predecessor of the match
+      dir = true;
+    } else {
+      int cmp_ret = cmp(key, q);
+
+      if (cmp_ret == 0) {
+        found = q;
+        dir = false;
+      } else {
+        dir = cmp_ret > 0;
+      }
+    }
+
+    // push the red node down
+    if (!is_red(q) && !is_red(get_link(q, dir))) {
+      if (is_red(get_link(q, !dir))) {
+        t_rbnode_td* top = rotate_single(q, dir);
+
+        set_link(p, last, top);
+        p = top;
+      } else {
+        t_rbnode_td* s = get_link(p, !last);
+
+        if (s != NULL) {
+          if (!is_red(get_link(s, !last)) && !is_red(get_link(s, last))) {
+            // color flip
+            set_red(p, false);
+            set_red(s, true);
+            set_red(q, true);
+          } else {
+            bool          dir2 = g->right == p;
+            t_rbnode_td*  top;
+
+            if (is_red(get_link(s, last)))
+              top = rotate_double(p, last);
+            else
+              top = rotate_single(p, last);
+            set_link(g, dir2, top);
+            set_red(q, true);
+            set_red(top, true);
+            set_red(get_link(top, false), false);
+            set_red(top->right, false);
+            if (p == found)
+              found_parent = top;
+          }
+        }
+      }
+    }
+    // p is the parent of q again
+    if (q == found)
+      found_parent = p;
+  }
+
+  if (found != NULL) {
+    // unlink q, which has at most one child
+    set_link(p, p->right == q, get_link(q, get_link(q, false) == NULL));
+    if (q != found) {
+      // q takes the place and color of the match
+      q->lc = found->lc;
+      q->right = found->right;
+      set_link(found_parent, found_parent->right == found, q);
+    }
+  }
+  tree->root = head.right;
+  if (tree->root != NULL)
+    set_red(tree->root, false);
+  return found;
+}
+
+t_rbnode_td*
+rb_td_find(const void* key, const t_rbtree_td* tree, t_compare_td cmp)
+{
+  t_rbnode_td* cur = tree->root;
+
+  while (cur != NULL) {
+    int cmp_ret = cmp(key, cur);
+    if (cmp_ret < 0)
+      cur = get_link(cur, false);
+    else if (cmp_ret > 0)
+      cur = cur->right;
+    else
+      return cur;
+  }
+  return NULL;
+}
+
+// pushes @node and its chain of left children, the next nodes in order.
+static t_rbnode_td*
+push_left(t_rbiter_td* iter, t_rbnode_td* node)
+{
+  while (node != NULL) {
+    assert(iter->depth < RB_TD_MAX_HEIGHT);
+    iter->stack[iter->depth++] = node;
+    node = get_link(node, false);
+  }
+  return iter->depth ? iter->stack[iter->depth - 1] : NULL;
+}
+
+/*
+ * @tree: tree to iterate
+ * @iter: caller's stack of the ancestors still to visit
+ *
+ * returns the first node in order, NULL if the tree is empty.
+ * the tree must not change while iterating.
+ */
+t_rbnode_td*
+rb_td_first(const t_rbtree_td* tree, t_rbiter_td* iter)
+{
+  iter->depth = 0;
+  return push_left(iter, tree->root);
+}
+
+t_rbnode_td*
+rb_td_next(t_rbiter_td* iter)
+{
+  t_rbnode_td* node;
+
+  if (iter->depth == 0)
+    return NULL;
+  node = iter->stack[--iter->depth];
+  push_left(iter, node->right);
+  return iter->depth ? iter->stack[iter->depth - 1] : NULL;
+}
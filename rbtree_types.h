@@ -11,8 +11,15 @@ typedef struct rbnode
     struct rbnode*  parent;
     bool            color: 1;
   } pc;
-  struct rbnode*  right;
-  struct rbnode*  left;
+  // child[0] is left and child[1] right, so a descent can index with a comparison.
+  // anonymous structs are a GNU extension in C++, marked so -pedantic accepts them.
+  union {
+    __extension__ struct {
+      struct rbnode*  left;
+      struct rbnode*  right;
+    };
+    struct rbnode*    child[2];
+  };
 } t_rbnode;
 
 typedef struct rbtree
@@ -24,10 +31,201 @@ typedef struct rbtree_cached
 {
   t_rbtree  rbtree;
   t_rbnode* leftmost_node;
+  t_rbnode* rightmost_node;
 } t_rbtree_cached;
 
+// tree with lockless readers, see rbtree_seq.c. seq is odd during a change.
+typedef struct rbtree_seq
+{
+  t_rbtree  rbtree;
+  unsigned  seq;
+} t_rbtree_seq;
+
+// node of an order-statistic tree, embedded instead of t_rbnode.
+typedef struct rbnode_os
+{
+  t_rbnode  node;
+  size_t    size; // nodes in the subtree rooted here
+} t_rbnode_os;
+
+typedef struct rbtree_os
+{
+  t_rbtree  rbtree;
+} t_rbtree_os;
+
+// node of an interval tree, the closed interval [start, last].
+typedef struct rbinterval
+{
+  t_rbnode  node;
+  int64_t   start;
+  int64_t   last;
+  int64_t   subtree_last; // largest last in the subtree rooted here
+} t_rbinterval;
+
+// 12 byte node linked by positions in one array, see rbtree_index.c.
+typedef struct rbnode32
+{
+  uint32_t    pc;       // parent position << 1 | color
+  union {
+    __extension__ struct {
+      uint32_t  left;
+      uint32_t  right;
+    };
+    uint32_t    child[2];
+  };
+} t_rbnode32;
+
+typedef struct rbtree32
+{
+  t_rbnode32*     nodes;  // nodes[0] is the nil node
+  const int64_t*  keys;   // keys[i] orders nodes[i]
+  uint32_t        root;
+} t_rbtree32;
+
+// 16 byte node without parent link, see rbtree_topdown.c.
+typedef struct rbnode_td
+{
+  uintptr_t         lc;     // left child | color
+  struct rbnode_td* right;
+} t_rbnode_td;
+
+typedef struct rbtree_td
+{
+  t_rbnode_td*  root;       // NULL if empty
+} t_rbtree_td;
+
+// enough for 2^48 nodes, a red-black tree is at most 2 * log2(n + 1) high.
+#define RB_TD_MAX_HEIGHT 96
+
+// caller's stack for in-order iteration of a t_rbtree_td.
+typedef struct rbiter_td
+{
+  t_rbnode_td*  stack[RB_TD_MAX_HEIGHT];
+  int           depth;
+} t_rbiter_td;
+
+/*
+ * node of a persistent tree, see rbtree_persistent.c.
+ * shared by every version that reaches it, so it has no parent link and
+ * holds a pointer to the item rather than being embedded in it.
+ */
+typedef struct rbpnode
+{
+  struct rbpnode* child[2];
+  void*           item;
+  uint32_t        refs;     // versions and parents pointing here
+  uint8_t         color;
+} t_rbpnode;
+
+// one version, changed in place by its updates while snapshots keep theirs.
+typedef struct rbptree
+{
+  t_rbpnode*  root;
+  size_t      size;
+} t_rbptree;
+
+typedef struct rbpiter
+{
+  const t_rbpnode*  stack[RB_TD_MAX_HEIGHT];
+  int               depth;
+} t_rbpiter;
+
+// weight of a nice 0 entity, vruntime advances at the rate of real time.
+#define RB_SCHED_NICE_0_LOAD 1024
+
+// CFS scheduling entity, queued by vruntime. see rbtree_sched.c
+typedef struct rbentity
+{
+  t_rbnode  node;
+  uint64_t  vruntime;
+  uint32_t  weight;
+  int       cpu;      // run queue holding it, -1 if none
+} t_rbentity;
+
+// run queue of one CPU, on its own cache line.
+typedef struct rbrunqueue
+{
+  t_rbtree_cached tasks;
+  t_rbentity*     curr;         // running, out of the tree
+  uint64_t        min_vruntime;
+  uint64_t        load;         // weights of curr and the queued entities
+  size_t          nr_running;
+  int             lock;
+} __attribute__((aligned(64))) t_rbrunqueue;
+
+typedef struct rbsched
+{
+  t_rbrunqueue*   rq;
+  int             cpus;
+} t_rbsched;
+
+/*
+ * node of a tree image, see rbtree_image.c. its record follows it.
+ * links are byte offsets from the node itself, 0 for nil, and the color is
+ * bit 0 of the parent offset as in t_rbnode.
+ */
+typedef struct rbinode
+{
+  int64_t pc;
+  int64_t left;
+  int64_t right;
+} t_rbinode;
+
+// a mapped image, read-only.
+typedef struct rbimage
+{
+  const char*       base;
+  size_t            length;
+  const t_rbinode*  root;
+  size_t            count;
+  size_t            record_size;
+} t_rbimage;
+
+/*
+ * read-only Eytzinger copy of a tree, see rbtree_snapshot.c.
+ * keys[k] is the key of nodes[k] for 1 <= k <= size.
+ */
+typedef struct rbsnapshot
+{
+  int64_t*    keys;
+  t_rbnode**  nodes;
+  size_t      size;
+  size_t      capacity;
+} t_rbsnapshot;
+
+/*
+ * node allocator, see rbtree_arena.c.
+ * freed slots are chained through their first bytes and reused first.
+ */
+typedef struct rbarena
+{
+  char*   base;
+  void*   free_list;
+  size_t  slot_size;
+  size_t  used;       // bytes handed out from base
+  size_t  size;       // bytes reserved
+} t_rbarena;
+
+/*
+ * callbacks keeping per-subtree data, such as sums or maxima, up to date.
+ * propagate: recompute @node and its ancestors up to @stop, excluded.
+ *            may stop early once a recomputed value is unchanged.
+ * copy:      @new_node took the place of @old, take over its data.
+ * rotate:    @new_node took the place of @old by a rotation,
+ *            take over its data and recompute @old.
+ */
+typedef struct rbaugment
+{
+  void  (*propagate)(t_rbnode* node, t_rbnode* stop);
+  void  (*copy)(t_rbnode* old, t_rbnode* new_node);
+  void  (*rotate)(t_rbnode* old, t_rbnode* new_node);
+} t_rbaugment;
+
 typedef int     (*t_compare)(const void*, const t_rbnode*);
 typedef bool    (*t_less)(t_rbnode*, const t_rbnode*);
 typedef void    (*t_swap)(t_rbnode*, t_rbnode*);
+typedef int     (*t_compare_td)(const void*, const t_rbnode_td*);
+typedef int     (*t_pcompare)(const void* key, const void* item);
+typedef bool    (*t_less_td)(t_rbnode_td*, const t_rbnode_td*);
 
 #endif // RBTREE_TYPES_H
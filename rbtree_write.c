@@ -7,11 +7,13 @@
  * https://en.wikipedia.org/wiki/Red-black_tree
  * https://elixir.bootlin.com/linux/latest/source/lib/rbtree.c
  */
+#include "rbtree.h"
 #include "rbtree_tools.h"
 
 #ifdef RB_DEBUG
 # include "rbtree_debug.h"
 # define DEBUG_FUNCTIONS(tree) \
+  nil_sanitizer(); \
   r4_sanitizer((tree)->root); \
   r5_sanitizer((tree)->root);
 #else
@@ -26,11 +28,36 @@
 # define VISUALIZE(tree)
 #endif
 
-static void insert_balance(t_rbtree* tree, t_rbnode* node);
-static void erase_balance(t_rbtree* tree, t_rbnode* node);
+static ALWAYS_INLINE void erase_propagate(t_rbnode* parent, t_rbnode* successor, const t_rbaugment* aug);
+
+#define RB_NODE                   t_rbnode
+#define RB_TREE                   t_rbtree
+#define RB_FN(name)               name
+#define RB_NIL                    (&rb_nil_node)
+#define RB_SET_ROOT(n)            (tree->root = (n))
+#define RB_CHILD(n, dir)          ((n)->child[dir])
+#define RB_SET_CHILD(n, dir, c)   ((n)->child[dir] = (c))
+#define RB_PARENT(n)              get_parent(n)
+#define RB_SET_PARENT(n, p)       set_parent(n, p)
+#define RB_COLOR(n)               get_color(n)
+#define RB_SET_COLOR(n, c)        set_color(n, c)
+#define RB_AUG_PARAM              , const t_rbaugment* aug
+#define RB_AUG_ARG                , aug
+#define RB_AUG_ROTATE(old, new_node) \
+  if (aug != NULL) aug->rotate(old, new_node)
+#define RB_AUG_COPY(old, new_node) \
+  if (aug != NULL) aug->copy(old, new_node)
+#define RB_AUG_PROPAGATE(parent, successor) \
+  erase_propagate(parent, successor, aug)
+#include "rbtree_balance.h"
 
-t_rbnode  rb_nil_node = {
-  {&rb_nil_node}, &rb_nil_node, &rb_nil_node,
+/*
+ * rb_nil_node is shared by every tree in the process and is never written
+ * after initialization (see set_child_parent), so trees owned by different
+ * threads only ever read its cache line.
+ */
+t_rbnode  rb_nil_node __attribute__((aligned(64))) = {
+  {&rb_nil_node}, {{&rb_nil_node, &rb_nil_node}},
 };
 t_rbnode* rb_nil = &rb_nil_node;
 /*
@@ -56,22 +83,16 @@ rb_insert(t_rbtree* tree, t_rbnode* node, t_less less)
   t_rbnode**  insert_at = &tree->root;
   t_rbnode*   parent = rb_nil;
 
-  // binary search to find place to insert
+  // binary search to find place to insert, indexing instead of branching
   while (*insert_at != rb_nil) {
-    bool less_ret;
-
     parent = *insert_at;
-    less_ret = less(node, parent);
-    if (less_ret)
-      insert_at = &parent->left;
-    else
-      insert_at = &parent->right;
+    insert_at = &parent->child[!less(node, parent)];
   }
   // create bidirectional edge between parent and new node
   link_node(parent, node, insert_at);
 
   // set color of inserted node red and rebalance if required.
-  insert_balance(tree, node);
+  insert_balance(tree, node, NULL);
   DEBUG_FUNCTIONS(tree);
   VISUALIZE(tree);
 }
@@ -81,90 +102,266 @@ rb_insert_cached(t_rbtree_cached* tree, t_rbnode* node, t_less less)
 {
   t_rbnode**  insert_at = &tree->rbtree.root;
   t_rbnode*   parent = rb_nil;
-  bool        leftmost = false;
+  bool        leftmost = true;
+  bool        rightmost = true;
+
+  // keys arriving in order are appended at a cached end without a descent.
+  // equal keys go right, so only a strictly smaller key is prepended.
+  if (tree->rightmost_node != NULL && !less(node, tree->rightmost_node)) {
+    parent = tree->rightmost_node;
+    insert_at = &parent->right;
+    leftmost = false;
+  } else if (tree->leftmost_node != NULL && less(node, tree->leftmost_node)) {
+    parent = tree->leftmost_node;
+    insert_at = &parent->left;
+    rightmost = false;
+  }
 
   while (*insert_at != rb_nil) {
-    bool  less_ret;
+    bool dir;
 
     parent = *insert_at;
-    less_ret = less(node, parent);
-    if (less_ret)
-      insert_at = &parent->left;
-    else {
-      insert_at = &parent->right;
-      less_ret = true;
-    }
+    dir = !less(node, parent);
+    insert_at = &parent->child[dir];
+    rightmost &= dir;
+    leftmost &= !dir;
   }
-  // if the node to be inserted is leftmost, cache it
+  // if the node to be inserted is leftmost or rightmost, cache it
   if (leftmost)
     tree->leftmost_node = node;
+  if (rightmost)
+    tree->rightmost_node = node;
 
   link_node(parent, node, insert_at);
-  insert_balance(&tree->rbtree, node);
+  insert_balance(&tree->rbtree, node, NULL);
   DEBUG_FUNCTIONS(&tree->rbtree);
   VISUALIZE(&tree->rbtree);
 }
 
-static void
-insert_balance(t_rbtree* tree, t_rbnode* node)
+/*
+ * finds where @node links next to @hint, comparing with @hint and one neighbour.
+ * @first and @last tell that @hint is known to be the minimum or maximum,
+ * which needs no neighbour: proving it otherwise climbs the whole spine.
+ * returns false if the node does not belong next to @hint.
+ */
+static bool
+hint_position(t_rbnode* node, t_rbnode* hint, t_less less, bool first, bool last,
+              t_rbnode** parent, t_rbnode*** insert_at)
 {
-  // loop for recursion
-  while (true) {
-    t_rbnode* parent = get_parent(node);
-
-    // case 1.
-    // previous root of the tree was nil and new node is root.
-    if (parent == rb_nil) {
-      node->pc.color = BLACK;
-      return;
+  t_rbnode* neighbor;
+
+  if (less(node, hint)) {
+    // belongs right before hint
+    if (first && hint->left == rb_nil) {
+      *parent = hint;
+      *insert_at = &hint->left;
+      return true;
     }
-
-    // case 2. 
-    // parent of inserted node is black.
-    if (get_color(parent) == BLACK) {
-      return;
+    neighbor = rb_prev(hint);
+    if (neighbor != NULL && less(node, neighbor))
+      return false;
+    // predecessor is the rightmost node of the left sub-tree if there is one.
+    *parent = hint->left == rb_nil ? hint : neighbor;
+    *insert_at = hint->left == rb_nil ? &hint->left : &neighbor->right;
+  } else {
+    // belongs right after hint
+    if (last && hint->right == rb_nil) {
+      *parent = hint;
+      *insert_at = &hint->right;
+      return true;
     }
+    neighbor = rb_next(hint);
+    if (neighbor != NULL && !less(node, neighbor))
+      return false;
+    *parent = hint->right == rb_nil ? hint : neighbor;
+    *insert_at = hint->right == rb_nil ? &hint->right : &neighbor->left;
+  }
+  return true;
+}
+
+/*
+ * @tree: red-black tree to insert in
+ * @node: new node
+ * @hint: node expected to be adjacent to the new node, e.g. the previous insertion
+ * @less: user provided boolean function which indicate less or not
+ *
+ * links the node next to @hint after comparing with @hint and one neighbour of it.
+ * falls back to rb_insert if the hint is wrong or NULL.
+ * equal keys still end up after the existing ones.
+ * a hint at the maximum still climbs the right spine to find it has no
+ * successor, rb_insert_hint_cached appends in O(1) instead.
+ */
+void
+rb_insert_hint(t_rbtree* tree, t_rbnode* node, t_rbnode* hint, t_less less)
+{
+  t_rbnode*   parent;
+  t_rbnode**  insert_at;
+
+  if (hint == NULL || !hint_position(node, hint, less, false, false, &parent, &insert_at)) {
+    rb_insert(tree, node, less);
+    return;
+  }
+  link_node(parent, node, insert_at);
+  insert_balance(tree, node, NULL);
+  DEBUG_FUNCTIONS(tree);
+  VISUALIZE(tree);
+}
+
+// rb_insert_hint keeping the cached ends, a hint at either end needs no neighbour.
+void
+rb_insert_hint_cached(t_rbtree_cached* tree, t_rbnode* node, t_rbnode* hint, t_less less)
+{
+  t_rbnode*   parent;
+  t_rbnode**  insert_at;
+
+  if (hint == NULL
+      || !hint_position(node, hint, less, hint == tree->leftmost_node, hint == tree->rightmost_node,
+                        &parent, &insert_at)) {
+    rb_insert_cached(tree, node, less);
+    return;
+  }
+  if (parent == tree->leftmost_node && insert_at == &parent->left)
+    tree->leftmost_node = node;
+  if (parent == tree->rightmost_node && insert_at == &parent->right)
+    tree->rightmost_node = node;
+  link_node(parent, node, insert_at);
+  insert_balance(&tree->rbtree, node, NULL);
+  DEBUG_FUNCTIONS(&tree->rbtree);
+  VISUALIZE(&tree->rbtree);
+}
+
+/*
+ * @tree: red-black tree to insert in
+ * @node: new node
+ * @less: user provided boolean function which indicate less or not
+ *
+ * links the node only if no equal node exists, in a single descent.
+ * the last node the descent went right at is the only candidate for equality,
+ * so one extra comparison replaces the rb_find before rb_insert.
+ * @less cannot tell equality on the way, so a duplicate still descends to a
+ * leaf, and the caller built a node for it. it saves comparisons, not time:
+ * bench_insert_unique (1M keys, 75% duplicates) measures it at 1.7-2x the
+ * time of rb_find + rb_insert. rb_insert_unique_key and rb_find_insert_pos
+ * stop at the equal node and need a node only for new keys; they make about
+ * 20% fewer comparisons and still measure 1.15-1.6x rb_find + rb_insert.
+ * returns NULL if linked, otherwise the existing equal node.
+ */
+t_rbnode*
+rb_insert_unique(t_rbtree* tree, t_rbnode* node, t_less less)
+{
+  t_rbnode**  insert_at = &tree->root;
+  t_rbnode*   parent = rb_nil;
+  t_rbnode*   candidate = NULL;
+
+  while (*insert_at != rb_nil) {
+    bool dir;
+
+    parent = *insert_at;
+    dir = !less(node, parent);
+    candidate = dir ? parent : candidate;
+    insert_at = &parent->child[dir];
+  }
+  if (candidate != NULL && !less(candidate, node))
+    return candidate;
 
-    // case 3.
-    // uncle node is red.
+  link_node(parent, node, insert_at);
+  insert_balance(tree, node, NULL);
+  DEBUG_FUNCTIONS(tree);
+  VISUALIZE(tree);
+  return NULL;
+}
 
-    // grand parent exists and its color is black because parent node is red.
-    t_rbnode* gparent;
-    t_rbnode* uncle;
-    bool      u_left = false;
+/*
+ * @tree: red-black tree to insert in
+ * @nodes: new nodes, equal keys end up in array order
+ * @n: number of nodes
+ * @less: user provided boolean function which indicate less or not
+ *
+ * every RB_BATCH_LANES nodes, their descents first run in turn one level at a
+ * time, prefetching only, so the misses along the paths overlap. the nodes are
+ * then inserted one by one with rb_insert over the paths now in cache.
+ * linking has to stay sequential since each insert may rotate the next path.
+ */
+void
+rb_insert_batch(t_rbtree* tree, t_rbnode** nodes, size_t n, t_less less)
+{
+  for (size_t base = 0; base < n; base += RB_BATCH_LANES) {
+    size_t    count = n - base < RB_BATCH_LANES ? n - base : RB_BATCH_LANES;
+    t_rbnode* cur[RB_BATCH_LANES];
+    bool      moving = true;
 
-    gparent = get_parent(parent);
-    if (gparent->left == parent) {
-      uncle = gparent->right;
-    } else {
-      u_left = true;
-      uncle = gparent->left;
+    for (size_t lane = 0; lane < count; ++lane) {
+      cur[lane] = tree->root;
+    }
+    while (moving) {
+      moving = false;
+      for (size_t lane = 0; lane < count; ++lane) {
+        t_rbnode* node = cur[lane];
+
+        if (node == rb_nil)
+          continue;
+        node = node->child[!less(nodes[base + lane], node)];
+        __builtin_prefetch(node);
+        cur[lane] = node;
+        moving = true;
+      }
     }
-    if (get_color(uncle) == RED) {
-      set_color(parent, BLACK);
-      set_color(uncle, BLACK);
-      set_color(gparent, RED);
-      node = gparent;
-      // recursive balancing as if gparent is inserted node.
-      continue;
+    for (size_t lane = 0; lane < count; ++lane) {
+      rb_insert(tree, nodes[base + lane], less);
     }
+  }
+}
 
-    // case 4.
-    // uncle node is black and has same branch direction with new node
-    bool  n_right = node == parent->right;
+/*
+ * @tree: red-black tree to insert in
+ * @node: new node
+ * @parent: node found by the caller's own descent, rb_nil for an empty tree
+ * @link: &parent->left, &parent->right or &tree->root
+ *
+ * lets callers that inline their comparison reuse the balancing logic.
+ */
+void
+rb_insert_at(t_rbtree* tree, t_rbnode* node, t_rbnode* parent, t_rbnode** link)
+{
+  link_node(parent, node, link);
+  insert_balance(tree, node, NULL);
+  DEBUG_FUNCTIONS(tree);
+  VISUALIZE(tree);
+}
 
-    if (n_right ^ u_left) {
-      rotate_nodes(tree, parent, !n_right);
-      swap_nodes(&node, &parent);
-    }
+/*
+ * @tree: red-black tree to insert in
+ * @node: new node, its augmented data need not be initialized
+ * @less: user provided boolean function which indicate less or not
+ * @aug: callbacks maintaining the augmented data
+ */
+void
+rb_insert_augmented(t_rbtree* tree, t_rbnode* node, t_less less, const t_rbaugment* aug)
+{
+  t_rbnode**  insert_at = &tree->root;
+  t_rbnode*   parent = rb_nil;
 
-    // case 5.
-    // uncle node is black and has different branch direction with new node
-    rotate_nodes(tree, gparent, !u_left);
-    set_color(parent, BLACK);
-    set_color(gparent, RED);
-    return;
+  while (*insert_at != rb_nil) {
+    parent = *insert_at;
+    insert_at = &parent->child[!less(node, parent)];
   }
+  link_node(parent, node, insert_at);
+  // the node alone first, so an early stop never skips its ancestors.
+  aug->propagate(node, parent);
+  aug->propagate(parent, rb_nil);
+  insert_balance(tree, node, aug);
+  DEBUG_FUNCTIONS(tree);
+  VISUALIZE(tree);
+}
+
+/*
+ * rebalances after a red @node was linked with its own subtrees, as rbtree_join.c does.
+ * returns true if the black height of the tree grew.
+ */
+bool
+rb_insert_balance(t_rbtree* tree, t_rbnode* node)
+{
+  return insert_balance(tree, node, NULL);
 }
 
 // section 2. erase
@@ -176,158 +373,150 @@ insert_balance(t_rbtree* tree, t_rbnode* node)
 void
 rb_erase(t_rbtree* tree, t_rbnode* node)
 {
-  t_rbnode* parent = get_parent(node);
-
+  if (node != rb_nil)
+    erase_node(tree, node, NULL);
+  DEBUG_FUNCTIONS(tree);
+  VISUALIZE(tree);
+}
 
-  if (node == rb_nil) goto ret;
+/*
+ * @tree: red-black tree to erase from
+ * @node: node to remove
+ * @aug: callbacks maintaining the augmented data
+ */
+void
+rb_erase_augmented(t_rbtree* tree, t_rbnode* node, const t_rbaugment* aug)
+{
+  if (node != rb_nil)
+    erase_node(tree, node, aug);
+  DEBUG_FUNCTIONS(tree);
+  VISUALIZE(tree);
+}
 
-  // case 1.
-  // node has two children
-  // let successor of the node be leftmost node of right sub-tree.
-  // successor has either no child node or right child node.
-  if (node->left != rb_nil && node->right != rb_nil) {
-    t_rbnode* successor = node->right;
-    while (successor->left != rb_nil) {
-      successor = successor->left;
-    }
-    swap_edges(parent, get_parent(successor), node, successor, tree);
-    parent = get_parent(node);
-    // node and succesor is swapped. node has either no child or one child which will be handled later.
+/*
+ * @parent: lowest node that lost a descendant
+ * @successor: node moved into the place of the erased one, or NULL
+ *
+ * only the path from @parent up to the root has changed subtrees.
+ */
+static ALWAYS_INLINE void
+erase_propagate(t_rbnode* parent, t_rbnode* successor, const t_rbaugment* aug)
+{
+  if (aug == NULL)
+    return;
+  if (successor != NULL) {
+    aug->propagate(parent, successor);
+    parent = successor;
   }
+  aug->propagate(parent, rb_nil);
+}
 
-  // case 2.
-  // node has one child which is red.
-  if (node->right != rb_nil) {
-    t_rbnode* right = node->right;
-    change_child(parent, node, right, tree);
-    set_parent(right, parent);
-    set_color(right, BLACK);
-    goto ret; // no requirements are violated.
-  } else if (node->left != rb_nil) {
-    t_rbnode* left = node->left;
-    change_child(parent, node, left, tree);
-    set_parent(left, parent);
-    set_color(left, BLACK);
-    goto ret;
+/*
+ * @tree: red-black tree to pop from
+ * @node: cached leftmost or rightmost node
+ * @left: node is leftmost
+ *
+ * the node has no child on the @left side, so it is unlinked in place without
+ * the successor search and swap_edges of rb_erase.
+ * returns the node that takes its place at that end.
+ */
+static t_rbnode*
+pop_end(t_rbtree* tree, t_rbnode* node, bool left)
+{
+  t_rbnode* parent = get_parent(node);
+  t_rbnode* child = get_far_child(node, left);
+
+  // the only child is a red leaf, which becomes the new end.
+  if (child != rb_nil) {
+    change_child(tree, parent, node, child);
+    set_parent(child, parent);
+    set_color(child, BLACK);
+    return child;
   }
-
-  // case 3.
-  // node has no child and is root.
+  change_child(tree, parent, node, rb_nil);
   if (parent == rb_nil) {
-    change_child(rb_nil, rb_nil, rb_nil, tree);
-    goto ret;
+    return NULL;
   }
-
-  // case 4.
-  // node has no child and is red.
-  if (get_color(node) == RED) {
-    change_child(parent, node, rb_nil, tree);
-    goto ret;
+  if (get_color(node) == BLACK) {
+    erase_balance(tree, parent, NULL);
   }
+  // rotations keep the in-order sequence, so parent is still the neighbour.
+  return parent;
+}
 
-  // case 5.
-  // node has no child and is black.
-  change_child(parent, node, rb_nil, tree);
-  erase_balance(tree, parent);
+t_rbnode*
+rb_pop_first(t_rbtree_cached* tree)
+{
+  t_rbnode* node = tree->leftmost_node;
 
-ret:
-  DEBUG_FUNCTIONS(tree);
-  VISUALIZE(tree);
+  if (node == NULL) return NULL;
+
+  tree->leftmost_node = pop_end(&tree->rbtree, node, true);
+  if (tree->rightmost_node == node) {
+    tree->rightmost_node = NULL;
+  }
+  DEBUG_FUNCTIONS(&tree->rbtree);
+  VISUALIZE(&tree->rbtree);
+  return node;
 }
 
-/*
- * handles erasing black node with no child.
- */
-static void
-erase_balance(t_rbtree* tree, t_rbnode* parent)
+t_rbnode*
+rb_pop_last(t_rbtree_cached* tree)
 {
-  t_rbnode* node = rb_nil;
-  t_rbnode* sibling;
-  t_rbnode* close_nephew;
-  t_rbnode* far_nephew;
-  bool      left;
-
-  while (true) {
-    // case 1.
-    // Node is root. -1 black height on every path.
-    if (parent == rb_nil) {
-      return;
-    }
+  t_rbnode* node = tree->rightmost_node;
 
-    if (node == parent->left) {
-      left = true;
-      sibling = parent->right;
-      close_nephew = sibling->left;
-      far_nephew = sibling->right;
-    } else {
-      left = false;
-      sibling = parent->left;
-      close_nephew = sibling->right;
-      far_nephew = sibling->left;
-    }
+  if (node == NULL) return NULL;
 
-    // case 2.
-    // S is red and other nodes are black.
-    // as a result no change on black height, the node and parent, but with different S, C, F positions.
-    if (get_color(sibling) == RED) {
-      rotate_nodes(tree, parent, !left);
-      set_color(sibling, BLACK);
-      set_color(parent, RED);
-      // sibling has changed. set affected nodes accordingly.
-      if (left) {
-        sibling = parent->right;
-        close_nephew = sibling->left;
-        far_nephew = sibling->right;
-      } else {
-        sibling = parent->left;
-        close_nephew = sibling->right;
-        far_nephew = sibling->left;
-      }
-    }
+  tree->rightmost_node = pop_end(&tree->rbtree, node, false);
+  if (tree->leftmost_node == node) {
+    tree->leftmost_node = NULL;
+  }
+  DEBUG_FUNCTIONS(&tree->rbtree);
+  VISUALIZE(&tree->rbtree);
+  return node;
+}
 
-case_3:
-    // case 3.
-    // F is red. sibling will inherit color of parent.
-    if (far_nephew != rb_nil && get_color(far_nephew) == RED) {
-      rotate_nodes(tree, parent, !left);
-      set_color(sibling, get_color(parent));
-      set_color(parent, BLACK);
-      set_color(far_nephew, BLACK);
-      return;
-    }
+// section 3. bulk build
 
-    // case 4.
-    // C is red and F is black. sibling will inherit color of parent.
-    if (close_nephew != rb_nil && get_color(close_nephew) == RED) {
-      rotate_nodes(tree, sibling, left);
-      set_color(close_nephew, BLACK);
-      set_color(sibling, RED);
-
-      // adjust nodes after rotation
-      far_nephew = sibling;
-      sibling = close_nephew;
-      close_nephew = left ? close_nephew->left : close_nephew->right;
-      goto case_3;
-    }
+/*
+ * links nodes[lo, hi) as a subtree under @parent by splitting at the midpoint.
+ * subtree sizes differ by at most one, so every nil is at depth red_depth or
+ * red_depth + 1 and only the nodes on the partial last level are red.
+ */
+static t_rbnode*
+build_sorted(t_rbnode** nodes, size_t lo, size_t hi, t_rbnode* parent, int depth, int red_depth)
+{
+  size_t    mid;
+  t_rbnode* node;
+
+  if (lo == hi)
+    return rb_nil;
+
+  mid = lo + (hi - lo) / 2;
+  node = nodes[mid];
+  node->pc.parent = parent;
+  node->pc.color = depth == red_depth ? RED : BLACK;
+  node->left = build_sorted(nodes, lo, mid, node, depth + 1, red_depth);
+  node->right = build_sorted(nodes, mid + 1, hi, node, depth + 1, red_depth);
+  return node;
+}
 
-    // case 5.
-    // P, S, C and F are black.
-    // one less black height on node side. requirement 5 is violated.
-    // change color of S as red and set P as new node and balance recursively.
-    // first iteration: the node is nil, other iterations: the node is root of subtree which has one less black height.
-    if (get_color(parent) == BLACK) {
-      set_color(sibling, RED);
-      node = parent;
-      parent = get_parent(parent);
-      continue;
-    }
-    // case 6.
-    // P is red and other nodes are black.
-    // changing color of P and S resolves requirement5 violation.
-    else {
-      set_color(parent, BLACK);
-      set_color(sibling, RED);
-      return;
-    }
-  }
+/*
+ * @tree: empty red-black tree
+ * @nodes: nodes in ascending order, equal keys in the order they should keep
+ * @n: number of nodes
+ *
+ * links the nodes into a valid tree in O(n) without comparisons or rotations.
+ */
+void
+rb_build_sorted(t_rbtree* tree, t_rbnode** nodes, size_t n)
+{
+  int red_depth = 0;
+
+  // floor(log2(n + 1)), the depth of the partial last level
+  while (((size_t)2 << red_depth) <= n + 1)
+    ++red_depth;
+  tree->root = build_sorted(nodes, 0, n, rb_nil, 0, red_depth);
+  DEBUG_FUNCTIONS(tree);
+  VISUALIZE(tree);
 }